@@ -1,16 +1,37 @@
 #include <iostream>
 #include <cmath>
 #include <fstream>
+#include <sstream>
 #include <vector>
 #include <time.h>
+#include <cstring>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <FTGL/ftgl.h>
+#include "shaders.h"
 #define sq(x) ((x)*(x))
 using namespace std;
 
@@ -18,6 +39,7 @@ struct VAO {
 	GLuint VertexArrayID;
 	GLuint VertexBuffer;
 	GLuint ColorBuffer;
+	GLsizeiptr VertexBytes,ColorBytes;   //capacity of the (possibly recycled) buffers
 
 	GLenum PrimitiveMode;
 	GLenum FillMode;
@@ -25,6 +47,213 @@ struct VAO {
 };
 typedef struct VAO VAO;
 
+/* Pool of GL objects released by destroy3DObject, reused by create3DObject across level loads */
+typedef struct gpupool{
+	vector<GLuint> arrays;                 //free vertex array objects
+	vector<pair<GLuint,GLsizeiptr> > buffers;   //free buffers and their capacity
+	vector<VAO*> vaos;                     //free VAO structs
+	long long livebytes=0,pooledbytes=0;   //debug counters
+	long long maxpooled=16<<20;            //free buffers beyond this are deleted
+	bool active=true;                      //false once the GL context is gone
+	GLuint getarray(){
+		GLuint id;
+		if(arrays.empty())glGenVertexArrays(1,&id);
+		else id=arrays.back(),arrays.pop_back();
+		return id;
+	}
+	GLuint getbuffer(GLsizeiptr bytes,const void* data,GLsizeiptr &capacity){
+		int best=-1;
+		for(int i=0;i<(int)buffers.size();++i){     //smallest free buffer that fits without wasting over half
+			GLsizeiptr c=buffers[i].second;
+			if(c>=bytes&&c<=2*bytes&&(best==-1||c<buffers[best].second))best=i;
+		}
+		GLuint id;
+		if(best!=-1){
+			id=buffers[best].first,capacity=buffers[best].second;
+			buffers[best]=buffers.back();
+			buffers.pop_back();
+			pooledbytes-=capacity;
+			glBindBuffer(GL_ARRAY_BUFFER,id);
+			glBufferSubData(GL_ARRAY_BUFFER,0,bytes,data);
+		}
+		else{
+			glGenBuffers(1,&id);
+			capacity=bytes;
+			glBindBuffer(GL_ARRAY_BUFFER,id);
+			glBufferData(GL_ARRAY_BUFFER,bytes,data,GL_STATIC_DRAW);
+		}
+		livebytes+=capacity;
+		return id;
+	}
+	void putbuffer(GLuint id,GLsizeiptr capacity){
+		livebytes-=capacity;
+		if(pooledbytes+capacity>maxpooled){
+			glDeleteBuffers(1,&id);
+			return;
+		}
+		buffers.push_back(make_pair(id,capacity));
+		pooledbytes+=capacity;
+	}
+	VAO* getvao(){
+		if(vaos.empty())return new struct VAO;
+		VAO* vao=vaos.back();
+		vaos.pop_back();
+		return vao;
+	}
+	void put(VAO* vao){
+		if(active){
+			putbuffer(vao->VertexBuffer,vao->VertexBytes);
+			putbuffer(vao->ColorBuffer,vao->ColorBytes);
+			arrays.push_back(vao->VertexArrayID);
+		}
+		vaos.push_back(vao);
+	}
+	void shutdown(){         //delete pooled GL objects,call while the context is still current
+		for(int i=0;i<(int)buffers.size();++i)glDeleteBuffers(1,&buffers[i].first);
+		if(!arrays.empty())glDeleteVertexArrays(arrays.size(),&arrays[0]);
+		buffers.clear(),arrays.clear();
+		pooledbytes=0;
+		active=false;
+	}
+	void print(){
+		printf("GPU: %lld bytes live, %lld bytes pooled\n",livebytes,pooledbytes);
+	}
+}gpupool;
+gpupool gpumem;
+
+/* Return the GL objects of vao to the pool */
+void destroy3DObject(VAO* vao){
+	if(vao)gpumem.put(vao);
+}
+
+/* Owning handle for a VAO, releases it to gpumem when replaced or destroyed */
+struct vaohandle{
+	VAO* vao;
+	vaohandle():vao(NULL){}
+	vaohandle(VAO* v):vao(v){}
+	vaohandle(vaohandle&& o):vao(o.vao){o.vao=NULL;}
+	vaohandle(const vaohandle&)=delete;
+	vaohandle& operator=(const vaohandle&)=delete;
+	vaohandle& operator=(vaohandle&& o){
+		if(this!=&o){
+			destroy3DObject(vao);
+			vao=o.vao;
+			o.vao=NULL;
+		}
+		return *this;
+	}
+	~vaohandle(){destroy3DObject(vao);}
+	operator VAO*() const{return vao;}
+	VAO* operator->() const{return vao;}
+};
+
+/* Per-frame vertex data (instance offsets, particles, the HUD), written by the
+   CPU straight into GL memory. One buffer is cut into FRAMES sections; each frame
+   takes the next section, first waiting on the fence set when it was last drawn
+   from (normally signalled long ago), and alloc() hands out pieces of it. With
+   ARB_buffer_storage the buffer stays mapped for good; without it (or with
+   --orphan) it is orphaned at the start of each frame and every piece is mapped
+   unsynchronized on its own. Either way the driver never copies or waits.
+   Sections grow with the level (reserve()), a piece that still does not fit
+   is not drawn and counted in dropped */
+bool ORPHAN = false;                  // --orphan, even where the buffer could stay mapped
+typedef struct streamring{
+	enum { FRAMES = 3 };
+	static const GLsizeiptr BASE = 4 << 20;       // particles, fragments, lives and the profiler graph
+	GLsizeiptr section = BASE;        // bytes per frame
+	GLuint buffer = 0;
+	char * mapped = NULL;             // all sections while persistent, NULL when orphaning
+	GLsync fences[FRAMES] = {};
+	int frame = 0;
+	GLsizeiptr used = 0;              // of this frame's section
+	long stalls = 0;                  // frames that found their section still in use
+	long dropped = 0;                 // allocs that did not fit, their draws skipped
+	void create() {
+		if(buffer)
+			return;
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		if(GLAD_GL_ARB_buffer_storage && !ORPHAN){
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBufferStorage(GL_ARRAY_BUFFER, FRAMES * section, NULL, flags);
+			mapped = (char *) glMapBufferRange(GL_ARRAY_BUFFER, 0, FRAMES * section, flags);
+		}
+		else
+			glBufferData(GL_ARRAY_BUFFER, section, NULL, GL_STREAM_DRAW);
+		printf("Vertex stream: %s, %ld MB per frame\n", mapped ? "persistently mapped, triple buffered" : "orphaned every frame", (long)(section >> 20));
+	}
+	/* Sections of at least bytes, between frames. The buffer is made again once
+	   the GPU is done with the old one */
+	void reserve(GLsizeiptr bytes) {
+		if(bytes <= section)
+			return;
+		section = (bytes + (1 << 20) - 1) & ~(GLsizeiptr)((1 << 20) - 1);
+		if(!buffer)
+			return;                   // create() makes it this size
+		for(int i = 0; i < FRAMES; ++i)
+			if(fences[i]){
+				glClientWaitSync(fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+				glDeleteSync(fences[i]);
+				fences[i] = 0;
+			}
+		if(mapped){
+			glBindBuffer(GL_ARRAY_BUFFER, buffer);
+			glUnmapBuffer(GL_ARRAY_BUFFER);
+		}
+		glDeleteBuffers(1, &buffer);
+		buffer = 0, mapped = NULL, frame = 0, used = 0;
+		create();
+	}
+	/* Start of a frame, before the first alloc() */
+	void begin() {
+		if(!buffer)
+			return;
+		used = 0;
+		if(!mapped){
+			glBindBuffer(GL_ARRAY_BUFFER, buffer);
+			glBufferData(GL_ARRAY_BUFFER, section, NULL, GL_STREAM_DRAW);    // the last frames keep the old storage
+			return;
+		}
+		frame = (frame + 1) % FRAMES;
+		if(fences[frame]){
+			if(glClientWaitSync(fences[frame], 0, 0) == GL_TIMEOUT_EXPIRED){
+				stalls++;
+				glClientWaitSync(fences[frame], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+			}
+			glDeleteSync(fences[frame]);
+			fences[frame] = 0;
+		}
+	}
+	/* bytes to write now and draw from this frame, at offset in buffer. Call
+	   commit() once written. NULL when the section is full */
+	char * alloc(GLsizeiptr bytes, GLintptr & offset) {
+		if(!buffer)
+			return NULL;
+		if(used + bytes > section){
+			dropped++;
+			return NULL;
+		}
+		offset = (mapped ? frame * section : 0) + used;
+		used += (bytes + 15) & ~(GLsizeiptr)15;         // attribute offsets stay aligned
+		if(mapped)
+			return mapped + offset;
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		return (char *) glMapBufferRange(GL_ARRAY_BUFFER, offset, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	}
+	void commit() {
+		if(mapped)
+			return;                   // coherent, visible to the next draw as it is
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+	}
+	/* After the frame's last draw from the section */
+	void end() {
+		if(mapped)
+			fences[frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+}streamring;
+streamring vertexstream;
+
 struct GLMatrices {
 	glm::mat4 projection;
 	glm::mat4 model;
@@ -40,83 +269,712 @@ struct FTGLFont {
 
 GLuint programID,fontProgramID;
 
-/* Function to load Shaders - Use it as it is */
-GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
+/* Read a whole shader file in one go, empty if it can not be opened */
+std::string readShaderFile(const char * file_path) {
+	std::ifstream ShaderStream(file_path, std::ios::in | std::ios::binary);
+	if(!ShaderStream.is_open()){
+		fprintf(stderr, "Error: could not open shader %s\n", file_path);
+		return "";
+	}
+	std::stringstream Code;
+	Code << ShaderStream.rdbuf();
+	return Code.str();
+}
 
-	// Create the shaders
-	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+/* Print the info log of a shader or program, only when there is something to say */
+void printInfoLog(GLuint id, bool program) {
+	int InfoLogLength = 0;
+	if(program)glGetProgramiv(id, GL_INFO_LOG_LENGTH, &InfoLogLength);
+	else glGetShaderiv(id, GL_INFO_LOG_LENGTH, &InfoLogLength);
+	if(InfoLogLength <= 1)
+		return;
+	std::vector<char> Message(InfoLogLength);
+	if(program)glGetProgramInfoLog(id, InfoLogLength, NULL, &Message[0]);
+	else glGetShaderInfoLog(id, InfoLogLength, NULL, &Message[0]);
+	fprintf(stdout, "%s\n", &Message[0]);
+}
 
-	// Read the Vertex Shader code from the file
-	std::string VertexShaderCode;
-	std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-	if(VertexShaderStream.is_open())
-	{
-		std::string Line = "";
-		while(getline(VertexShaderStream, Line))
-			VertexShaderCode += "\n" + Line;
-		VertexShaderStream.close();
-	}
+GLuint compileShader(GLenum type, const std::string & code, const char * name) {
+	GLuint ShaderID = glCreateShader(type);
+	char const * SourcePointer = code.c_str();
+	glShaderSource(ShaderID, 1, &SourcePointer , NULL);
+	glCompileShader(ShaderID);
+
+	GLint Result = GL_FALSE;
+	glGetShaderiv(ShaderID, GL_COMPILE_STATUS, &Result);
+	if(!Result)fprintf(stdout, "Compiling shader %s failed\n", name);
+	printInfoLog(ShaderID, false);
+	return ShaderID;
+}
+
+/* Compiled programs are cached in SHADERCACHE via glGetProgramBinary,
+   keyed by a hash of both sources and the driver strings */
+const char * SHADERCACHE = "shadercache";
 
-	// Read the Fragment Shader code from the file
-	std::string FragmentShaderCode;
-	std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-	if(FragmentShaderStream.is_open()){
-		std::string Line = "";
-		while(getline(FragmentShaderStream, Line))
-			FragmentShaderCode += "\n" + Line;
-		FragmentShaderStream.close();
+unsigned long long fnv1a(const std::string & data, unsigned long long hash = 14695981039346656037ULL) {
+	for(size_t i = 0; i < data.size(); ++i){
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ULL;
 	}
+	return hash;
+}
+
+bool programBinarySupported() {
+	if(!GLAD_GL_ARB_get_program_binary)
+		return false;
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	return formats > 0;
+}
+
+std::string programCachePath(const std::string & VertexShaderCode, const std::string & FragmentShaderCode) {
+	std::string key = VertexShaderCode + '\0' + FragmentShaderCode + '\0';
+	key += (const char *)glGetString(GL_VENDOR);
+	key += (const char *)glGetString(GL_RENDERER);
+	key += (const char *)glGetString(GL_VERSION);
+	char path[256];
+	snprintf(path, sizeof(path), "%s/%016llx.bin", SHADERCACHE, fnv1a(key));
+	return path;
+}
+
+/* Returns 0 if there is no usable cached binary (missing, or rejected by the driver) */
+GLuint loadProgramBinary(const std::string & path) {
+	std::ifstream CacheStream(path.c_str(), std::ios::in | std::ios::binary);
+	if(!CacheStream.is_open())
+		return 0;
+	GLenum format = 0;
+	CacheStream.read((char *)&format, sizeof(format));
+	std::string binary((std::istreambuf_iterator<char>(CacheStream)), std::istreambuf_iterator<char>());
+	if(!CacheStream.good() && !CacheStream.eof())
+		return 0;
 
+	GLuint ProgramID = glCreateProgram();
+	glProgramBinary(ProgramID, format, binary.data(), binary.size());
 	GLint Result = GL_FALSE;
-	int InfoLogLength;
-
-	// Compile Vertex Shader
-	printf("Compiling shader : %s\n", vertex_file_path);
-	char const * VertexSourcePointer = VertexShaderCode.c_str();
-	glShaderSource(VertexShaderID, 1, &VertexSourcePointer , NULL);
-	glCompileShader(VertexShaderID);
-
-	// Check Vertex Shader
-	glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> VertexShaderErrorMessage(InfoLogLength);
-	glGetShaderInfoLog(VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
-	fprintf(stdout, "%s\n", &VertexShaderErrorMessage[0]);
-
-	// Compile Fragment Shader
-	printf("Compiling shader : %s\n", fragment_file_path);
-	char const * FragmentSourcePointer = FragmentShaderCode.c_str();
-	glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer , NULL);
-	glCompileShader(FragmentShaderID);
-
-	// Check Fragment Shader
-	glGetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> FragmentShaderErrorMessage(InfoLogLength);
-	glGetShaderInfoLog(FragmentShaderID, InfoLogLength, NULL, &FragmentShaderErrorMessage[0]);
-	fprintf(stdout, "%s\n", &FragmentShaderErrorMessage[0]);
+	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+	if(!Result){
+		glDeleteProgram(ProgramID);
+		return 0;
+	}
+	return ProgramID;
+}
+
+void saveProgramBinary(GLuint ProgramID, const std::string & path) {
+	GLint length = 0;
+	glGetProgramiv(ProgramID, GL_PROGRAM_BINARY_LENGTH, &length);
+	if(length <= 0)
+		return;
+	std::vector<char> binary(length);
+	GLenum format = 0;
+	glGetProgramBinary(ProgramID, length, NULL, &format, &binary[0]);
+
+	mkdir(SHADERCACHE, 0755);
+	std::string tmp = path + ".tmp";           // write then rename so a crash never leaves a torn entry
+	std::ofstream CacheStream(tmp.c_str(), std::ios::out | std::ios::binary);
+	if(!CacheStream.is_open())
+		return;
+	CacheStream.write((const char *)&format, sizeof(format));
+	CacheStream.write(&binary[0], length);
+	CacheStream.close();
+	if(CacheStream.fail() || rename(tmp.c_str(), path.c_str()) != 0)
+		remove(tmp.c_str());
+}
+
+/* Build a program from GLSL sources, from the binary cache when possible */
+GLuint buildProgram(const std::string & VertexShaderCode, const std::string & FragmentShaderCode, const char * vertex_name, const char * fragment_name) {
+	bool cache = programBinarySupported();
+	std::string cachepath;
+	if(cache){
+		cachepath = programCachePath(VertexShaderCode, FragmentShaderCode);
+		GLuint ProgramID = loadProgramBinary(cachepath);
+		if(ProgramID)
+			return ProgramID;
+	}
+
+	// Compile both stages
+	printf("Compiling shaders : %s %s\n", vertex_name, fragment_name);
+	GLuint VertexShaderID = compileShader(GL_VERTEX_SHADER, VertexShaderCode, vertex_name);
+	GLuint FragmentShaderID = compileShader(GL_FRAGMENT_SHADER, FragmentShaderCode, fragment_name);
 
 	// Link the program
-	fprintf(stdout, "Linking program\n");
 	GLuint ProgramID = glCreateProgram();
+	if(cache)glProgramParameteri(ProgramID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	glAttachShader(ProgramID, VertexShaderID);
 	glAttachShader(ProgramID, FragmentShaderID);
 	glLinkProgram(ProgramID);
 
 	// Check the program
+	GLint Result = GL_FALSE;
 	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
-	glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> ProgramErrorMessage( max(InfoLogLength, int(1)) );
-	glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
-	fprintf(stdout, "%s\n", &ProgramErrorMessage[0]);
+	if(!Result)fprintf(stdout, "Linking program failed\n");
+	printInfoLog(ProgramID, true);
 
+	glDetachShader(ProgramID, VertexShaderID);
+	glDetachShader(ProgramID, FragmentShaderID);
 	glDeleteShader(VertexShaderID);
 	glDeleteShader(FragmentShaderID);
 
+	if(Result && cache)
+		saveProgramBinary(ProgramID, cachepath);
 	return ProgramID;
 }
 
+/* GLSL sources compiled into the binary, see the shaders.h rule in the Makefile */
+struct embeddedShader {
+	const char * name;
+	const char * source;
+} EmbeddedShaders[] = {
+	{"Sample_GL.vert", Sample_GL_vert},
+	{"Sample_GL.frag", Sample_GL_frag},
+	{"fontrender.vert", fontrender_vert},
+	{"fontrender.frag", fontrender_frag},
+	{"Particle.vert", Particle_vert},
+	{"Background.vert", Background_vert},
+	{"Background.frag", Background_frag},
+};
+
+/* When set (--shaders <dir>) shaders are read from this directory instead, for development */
+const char * SHADERDIR = NULL;
+
+std::string shaderSource(const char * name) {
+	if(SHADERDIR)
+		return readShaderFile((std::string(SHADERDIR) + "/" + name).c_str());
+	for(size_t i = 0; i < sizeof(EmbeddedShaders)/sizeof(EmbeddedShaders[0]); ++i)
+		if(!strcmp(EmbeddedShaders[i].name, name))
+			return EmbeddedShaders[i].source;
+	fprintf(stderr, "Error: no embedded shader %s\n", name);
+	return "";
+}
+
+/* Function to load Shaders - Use it as it is */
+GLuint LoadShaders(const char * vertex_name,const char * fragment_name) {
+	return buildProgram(shaderSource(vertex_name), shaderSource(fragment_name), vertex_name, fragment_name);
+}
+
+/* Trace recorder for chrome://tracing and Perfetto. Each thread writes begin/end
+   events into its own preallocated ring with no locks; the oldest events are
+   overwritten when a ring is full. Threads must call registerthread() first */
+bool TRACING = false;
+const char * TRACEFILE = NULL;        // --trace <file>, written at exit and on 'T'
+
+struct traceevent {
+	const char * name;                // must be a string literal
+	long long ns;
+	char phase;                       // 'B' or 'E'
+};
+struct tracebuffer {
+	enum { CAPACITY = 1 << 18 };
+	traceevent events[CAPACITY];
+	std::atomic<unsigned long long> count;
+	const char * thread;
+	int tid;
+};
+thread_local tracebuffer * TRACELOCAL = NULL;
+
+typedef struct tracer{
+	enum { MAXTHREADS = 16 };
+	std::atomic<tracebuffer *> buffers[MAXTHREADS];
+	std::atomic<int> threads;
+	std::chrono::steady_clock::time_point epoch;
+
+	void start() {
+		epoch = std::chrono::steady_clock::now();
+		threads = 0;
+		TRACING = true;
+	}
+	/* Allocates the calling thread's ring, call outside the frame */
+	void registerthread(const char * name) {
+		if(!TRACING)
+			return;
+		int i = threads++;
+		if(i >= MAXTHREADS)
+			return;
+		tracebuffer * b = new tracebuffer;
+		b->count = 0;
+		b->thread = name;
+		b->tid = i + 1;
+		buffers[i] = b;
+		TRACELOCAL = b;
+	}
+	void record(const char * name, char phase) {
+		tracebuffer * b = TRACELOCAL;
+		if(!b)
+			return;
+		unsigned long long i = b->count.load(std::memory_order_relaxed);
+		traceevent & e = b->events[i & (tracebuffer::CAPACITY - 1)];
+		e.name = name;
+		e.phase = phase;
+		e.ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+		b->count.store(i + 1, std::memory_order_release);
+	}
+	void write(const char * path) {
+		if(!TRACING || !path)
+			return;
+		FILE * out = fopen(path, "w");
+		if(!out){
+			fprintf(stderr, "Error: could not write %s\n", path);
+			return;
+		}
+		fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+		bool first = true;
+		int n = min((int)threads, (int)MAXTHREADS);
+		for(int t = 0; t < n; ++t){
+			tracebuffer * b = buffers[t];
+			if(!b)
+				continue;
+			fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", b->tid, b->thread);
+			first = false;
+			unsigned long long end = b->count.load(std::memory_order_acquire);
+			unsigned long long begin = end > tracebuffer::CAPACITY ? end - tracebuffer::CAPACITY : 0;
+			for(unsigned long long i = begin; i < end; ++i){
+				traceevent & e = b->events[i & (tracebuffer::CAPACITY - 1)];
+				fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d}", e.name, e.phase, e.ns / 1000.0, b->tid);
+			}
+		}
+		fprintf(out, "\n]}\n");
+		fclose(out);
+		printf("Trace written to %s\n", path);
+	}
+}tracer;
+tracer trace;
+
+struct tracescope{
+	const char * name;
+	bool on;
+	tracescope(const char * n):name(n),on(TRACING) {
+		if(on)trace.record(name, 'B');
+	}
+	~tracescope() {
+		if(on)trace.record(name, 'E');
+	}
+};
+#define TRACEJOIN(a,b) a##b
+#define TRACEVAR(line) TRACEJOIN(tracescope_,line)
+#define TRACE(name) tracescope TRACEVAR(__LINE__)(name)
+
+#ifndef GL_COMPLETION_STATUS_ARB
+#define GL_COMPLETION_STATUS_ARB 0x91B1
+#endif
+
+/* A program relinked when one of its shader files changes */
+struct hotProgram {
+	const char * vertex_name, * fragment_name;
+	GLuint * program;             // swapped in place on success
+	void (*swapped)(GLuint);      // refresh uniform locations of the new program
+	GLuint pending;               // program being linked, 0 if none
+};
+
+/* Shader hot reload for SHADERDIR. The watcher thread waits on inotify and reads
+   changed files; the render thread relinks at the next frame boundary and swaps
+   the program once it links, keeping the old one on failure */
+typedef struct shaderwatcher{
+	std::thread thread;
+	std::mutex lock;
+	std::map<std::string,std::string> sources;   // latest source of every watched file
+	std::set<std::string> changed;               // files changed since the last poll()
+	std::atomic<bool> dirty, stop;
+	std::vector<hotProgram> programs;
+	int fd = -1;
+
+	void add(const char * vertex_name, const char * fragment_name, GLuint * program, void (*swapped)(GLuint)) {
+		hotProgram p = {vertex_name, fragment_name, program, swapped, 0};
+		programs.push_back(p);
+		sources[vertex_name] = shaderSource(vertex_name);
+		sources[fragment_name] = shaderSource(fragment_name);
+	}
+	void start() {
+		fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		// editors often save by writing a new file and renaming it over the old one
+		if(fd < 0 || inotify_add_watch(fd, SHADERDIR, IN_CLOSE_WRITE | IN_MOVED_TO) < 0){
+			fprintf(stderr, "Error: can not watch %s, shader hot reload disabled\n", SHADERDIR);
+			return;
+		}
+		dirty = stop = false;
+		thread = std::thread(&shaderwatcher::run, this);
+	}
+	void run() {
+		trace.registerthread("shaderwatch");
+		char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+		struct pollfd pfd = {fd, POLLIN, 0};
+		while(!stop){
+			if(::poll(&pfd, 1, 100) <= 0)
+				continue;
+			ssize_t len = read(fd, buf, sizeof(buf));
+			for(char * p = buf; p < buf + len; ){
+				struct inotify_event * event = (struct inotify_event *)p;
+				p += sizeof(struct inotify_event) + event->len;
+				if(!event->len || !sources.count(event->name))      // keys are fixed once started
+					continue;
+				TRACE("shader read");
+				std::string code = shaderSource(event->name);
+				if(code.empty())
+					continue;
+				std::lock_guard<std::mutex> guard(lock);
+				sources[event->name] = code;
+				changed.insert(event->name);
+				dirty = true;
+			}
+		}
+	}
+	/* Called by the render thread at the start of a frame */
+	void poll() {
+		if(dirty){
+			TRACE("shader relink");
+			std::lock_guard<std::mutex> guard(lock);
+			for(size_t i = 0; i < programs.size(); ++i)
+				if(changed.count(programs[i].vertex_name) || changed.count(programs[i].fragment_name))
+					begin(programs[i]);
+			changed.clear();
+			dirty = false;
+		}
+		for(size_t i = 0; i < programs.size(); ++i)
+			if(programs[i].pending)
+				end(programs[i]);
+	}
+	/* Issue compile and link without waiting on the result */
+	void begin(hotProgram & p) {
+		if(p.pending)
+			glDeleteProgram(p.pending);
+		p.pending = glCreateProgram();
+		const char * names[2] = {p.vertex_name, p.fragment_name};
+		GLenum types[2] = {GL_VERTEX_SHADER, GL_FRAGMENT_SHADER};
+		for(int i = 0; i < 2; ++i){
+			GLuint ShaderID = glCreateShader(types[i]);
+			char const * SourcePointer = sources[names[i]].c_str();
+			glShaderSource(ShaderID, 1, &SourcePointer, NULL);
+			glCompileShader(ShaderID);
+			glAttachShader(p.pending, ShaderID);
+			glDeleteShader(ShaderID);         // freed with the program
+		}
+		if(programBinarySupported())glProgramParameteri(p.pending, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		glLinkProgram(p.pending);
+	}
+	/* Swap in the pending program once the driver is done with it */
+	void end(hotProgram & p) {
+		GLint Result = GL_FALSE;
+		if(GLAD_GL_ARB_parallel_shader_compile){
+			glGetProgramiv(p.pending, GL_COMPLETION_STATUS_ARB, &Result);
+			if(!Result)
+				return;              // still compiling, check again next frame
+		}
+		glGetProgramiv(p.pending, GL_LINK_STATUS, &Result);
+		if(!Result){
+			GLuint shaders[2];
+			GLsizei count = 0;
+			glGetAttachedShaders(p.pending, 2, &count, shaders);
+			for(int i = 0; i < count; ++i)printInfoLog(shaders[i], false);
+			printInfoLog(p.pending, true);
+			fprintf(stdout, "Reloading %s %s failed, keeping the old program\n", p.vertex_name, p.fragment_name);
+			glDeleteProgram(p.pending);
+			p.pending = 0;
+			return;
+		}
+		fprintf(stdout, "Reloaded %s %s\n", p.vertex_name, p.fragment_name);
+		if(programBinarySupported()){
+			std::unique_lock<std::mutex> guard(lock);
+			std::string path = programCachePath(sources[p.vertex_name], sources[p.fragment_name]);
+			guard.unlock();
+			saveProgramBinary(p.pending, path);
+		}
+		glDeleteProgram(*p.program);
+		*p.program = p.pending;
+		p.pending = 0;
+		if(p.swapped)p.swapped(*p.program);
+	}
+	void finish() {
+		if(thread.joinable()){
+			stop = true;
+			thread.join();
+		}
+		if(fd >= 0)close(fd);
+		fd = -1;
+	}
+}shaderwatcher;
+shaderwatcher shaderwatch;
+
+/* Work-stealing job system. parallelFor cuts a range into jobs and pushes them
+   on the calling thread's deque; each thread takes jobs from the bottom of its
+   own deque and, when that is empty, steals from the top of another's (Chase-Lev
+   deques, no locks). The caller works too and returns once its jobs are done.
+   Idle workers yield for a while, then park until more jobs are pushed */
+int THREADS = 0;                      // --threads <n>, 0 is one per core
+thread_local int JOBSLOT = 0;         // this thread's deque, 0 for the main thread
+
+typedef struct job{
+	void (*run)(void * data, int begin, int end);
+	void * data;
+	int begin, end;
+	std::atomic<int> * left;          // jobs of its parallelFor not finished yet
+}job;
+
+typedef struct jobdeque{
+	enum { CAPACITY = 1 << 12 };
+	alignas(64) std::atomic<long long> top;      // stolen from here
+	alignas(64) std::atomic<long long> bottom;   // owner pushes and pops here
+	std::atomic<job *> slots[CAPACITY];
+
+	/* false when full, then the caller runs j itself. Nested parallelFor calls
+	   stack their pieces on the same deque, so it can fill up */
+	bool push(job * j) {
+		long long b = bottom.load(std::memory_order_relaxed);
+		if(b - top.load(std::memory_order_acquire) >= CAPACITY)
+			return false;
+		slots[b & (CAPACITY - 1)].store(j, std::memory_order_relaxed);
+		bottom.store(b + 1, std::memory_order_release);    // the job is visible to a thief that sees it
+		return true;
+	}
+	job * pop() {
+		long long b = bottom.load(std::memory_order_relaxed) - 1;
+		bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		long long t = top.load(std::memory_order_relaxed);
+		if(t > b){                    // empty
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return NULL;
+		}
+		job * j = slots[b & (CAPACITY - 1)].load(std::memory_order_relaxed);
+		if(t == b){                   // the last one, a thief may be taking it too
+			if(!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+				j = NULL;
+			bottom.store(b + 1, std::memory_order_relaxed);
+		}
+		return j;
+	}
+	job * steal() {
+		long long t = top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		long long b = bottom.load(std::memory_order_acquire);
+		if(t >= b)
+			return NULL;
+		job * j = slots[t & (CAPACITY - 1)].load(std::memory_order_relaxed);
+		if(!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			return NULL;              // lost the race, try elsewhere
+		return j;
+	}
+}jobdeque;
+
+typedef struct jobsystem{
+	enum { MAXJOBS = 256, SPINS = 2000 };
+	int threads = 1;                  // including the main thread
+	jobdeque * deques = NULL;
+	std::vector<std::thread> workers;
+	std::atomic<unsigned> pushed;     // bumped whenever jobs are pushed
+	std::atomic<int> sleepers;
+	std::atomic<bool> stop;
+	std::mutex parklock;              // only to park idle workers, never to push or take jobs
+	std::condition_variable park;
+
+	/* n threads in all, the caller is one of them */
+	void start(int n) {
+		finish();
+		threads = max(n, 1);
+		deques = new jobdeque[threads];
+		for(int i = 0; i < threads; ++i)
+			deques[i].top = deques[i].bottom = 0;
+		pushed = 0, sleepers = 0, stop = false;
+		JOBSLOT = 0;
+		for(int i = 1; i < threads; ++i)
+			workers.push_back(std::thread(&jobsystem::work, this, i));
+	}
+	void finish() {
+		if(!workers.empty()){
+			stop = true;
+			{ std::lock_guard<std::mutex> guard(parklock); }
+			park.notify_all();
+			for(size_t i = 0; i < workers.size(); ++i)
+				workers[i].join();
+			workers.clear();
+		}
+		delete[] deques;
+		deques = NULL;
+		threads = 1;
+	}
+	~jobsystem() { finish(); }
+	/* Own deque first, then the others in turn starting with the next one */
+	job * find(int self) {
+		job * j = deques[self].pop();
+		for(int i = 1; !j && i < threads; ++i)
+			j = deques[(self + i) % threads].steal();
+		return j;
+	}
+	void run(job * j) {
+		TRACE("job");
+		j->run(j->data, j->begin, j->end);
+		j->left->fetch_sub(1, std::memory_order_release);
+	}
+	void work(int self) {
+		JOBSLOT = self;
+		trace.registerthread("worker");
+		int idle = 0;
+		while(!stop){
+			unsigned seen = pushed.load();
+			job * j = find(self);
+			if(j){
+				run(j);
+				idle = 0;
+				continue;
+			}
+			if(++idle < SPINS){
+				std::this_thread::yield();
+				continue;
+			}
+			std::unique_lock<std::mutex> guard(parklock);
+			sleepers++;
+			while(pushed.load() == seen && !stop)
+				park.wait(guard);
+			sleepers--;
+			idle = 0;
+		}
+	}
+	template<typename F> static void call(void * data, int begin, int end) {
+		(*(F *)data)(begin, end);
+	}
+	/* f(begin, end) over [0, count) in pieces of at least grain, in parallel.
+	   Pieces of one call must not write to the same data */
+	template<typename F> void parallelFor(int count, int grain, F f) {
+		int n = threads > 1 ? min(min((count + grain - 1) / max(grain, 1), 4 * threads), (int)MAXJOBS) : 1;
+		if(n <= 1){
+			if(count > 0)
+				f(0, count);
+			return;
+		}
+		job pieces[MAXJOBS];
+		std::atomic<int> left(n);
+		for(int i = n - 1; i >= 0; --i){    // the caller pops the first piece first
+			job j = {call<F>, &f, (int)((long long)count * i / n), (int)((long long)count * (i + 1) / n), &left};
+			pieces[i] = j;
+			if(!deques[JOBSLOT].push(&pieces[i]))
+				run(&pieces[i]);          // deque full, no one else gets this piece
+		}
+		pushed++;
+		if(sleepers.load() > 0){
+			{ std::lock_guard<std::mutex> guard(parklock); }
+			park.notify_all();
+		}
+		while(left.load(std::memory_order_acquire) > 0){
+			job * j = find(JOBSLOT);
+			if(j)
+				run(j);
+			else
+				std::this_thread::yield();
+		}
+	}
+}jobsystem;
+jobsystem jobs;
+
+/* Frame profiler. A profilescope adds the time until it is stopped (or goes out of
+   scope) to its phase of the current frame, and records it in the trace when
+   tracing; costs one branch when both are off */
+enum { PHASE_PHYSICS, PHASE_RENDER, PHASE_COLLISION, PHASE_CLEAR, PHASE_SWAP, PHASE_EVENTS, PHASES };
+const char * PHASENAMES[PHASES] = {"physics", "render", "collision", "clearcollisions", "swap", "events"};
+/* Render passes timed on the GPU by gputimer */
+enum { GPU_STATIC, GPU_OBSTACLES, GPU_CANNON, GPU_BALLS, GPU_HUD, GPU_PARTICLES, GPUPASSES };
+const char * GPUPASSNAMES[GPUPASSES] = {"gpu static", "gpu obstacles", "gpu cannon", "gpu balls", "gpu hud", "gpu particles"};
+bool PROFILING = false;
+const char * PROFILEFILE = NULL;      // --profile <file>, written at exit
+
+typedef struct profiler{
+	enum { FRAMES = 240 };           // rolling window
+	// rows: cpu phases, the whole frame, gpu passes, input to present latency
+	enum { FRAMEROW = PHASES, GPUROW = PHASES + 1, LATENCYROW = GPUROW + GPUPASSES, ROWS = LATENCYROW + 1 };
+	float times[ROWS][FRAMES];       // ms
+	double current[ROWS];
+	int frame = 0, count = 0;
+	bool started = false;            // last is valid
+	std::chrono::steady_clock::time_point last;
+	GLuint graph = 0;                // vertex array, its quads are written to vertexstream
+
+	void add(int row, double ms) {
+		current[row] += ms;
+	}
+	void peak(int row, double ms) {  // for rows that are not sums, like latency
+		current[row] = max(current[row], ms);
+	}
+	const char * rowname(int row) {
+		if(row < PHASES)
+			return PHASENAMES[row];
+		if(row == FRAMEROW)
+			return "frame";
+		if(row == LATENCYROW)
+			return "input latency";
+		return GPUPASSNAMES[row - GPUROW];
+	}
+	void endframe() {
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if(started){
+			current[FRAMEROW] = std::chrono::duration<double, std::milli>(now - last).count();
+			for(int r = 0; r < ROWS; ++r)
+				times[r][frame] = current[r];
+			frame = (frame + 1) % FRAMES;
+			count = min(count + 1, (int)FRAMES);
+			if(frame == 0)print(stdout);
+		}
+		started = true;
+		for(int r = 0; r < ROWS; ++r)
+			current[r] = 0;
+		last = now;
+	}
+	float percentile(int row, float q) {
+		if(!count)
+			return 0;
+		std::vector<float> sorted(times[row], times[row] + count);
+		std::sort(sorted.begin(), sorted.end());
+		return sorted[min(count - 1, (int)(q * count))];
+	}
+	void print(FILE * out) {
+		fprintf(out, "%-16s %8s %8s %8s   (ms over %d frames)\n", "phase", "p50", "p99", "max", count);
+		for(int r = 0; r < ROWS; ++r)
+			fprintf(out, "%-16s %8.3f %8.3f %8.3f\n", rowname(r), percentile(r, 0.5), percentile(r, 0.99), percentile(r, 1.0));
+	}
+	void finish() {
+		if(!PROFILEFILE)
+			return;
+		FILE * out = fopen(PROFILEFILE, "w");
+		if(!out){
+			fprintf(stderr, "Error: could not write %s\n", PROFILEFILE);
+			return;
+		}
+		print(out);
+		fprintf(out, "\n");                 // raw window, oldest frame first
+		for(int r = 0; r < ROWS; ++r)fprintf(out, "%s%s", r ? "," : "", rowname(r));
+		fprintf(out, "\n");
+		for(int i = 0; i < count; ++i){
+			int f = (frame - count + i + FRAMES) % FRAMES;
+			for(int r = 0; r < ROWS; ++r)fprintf(out, "%s%.3f", r ? "," : "", times[r][f]);
+			fprintf(out, "\n");
+		}
+		fclose(out);
+	}
+	void draw();
+}profiler;
+profiler prof;
+
+struct profilescope{
+	int phase;
+	bool running;
+	std::chrono::steady_clock::time_point begin;
+	profilescope(int p):phase(p),running(false) {
+		start();
+	}
+	~profilescope() {
+		stop();
+	}
+	void start() {
+		if((PROFILING || TRACING) && !running){
+			running = true;
+			begin = std::chrono::steady_clock::now();
+			if(TRACING)trace.record(PHASENAMES[phase], 'B');
+		}
+	}
+	void stop() {
+		if(running){
+			running = false;
+			if(TRACING)trace.record(PHASENAMES[phase], 'E');
+			if(PROFILING)prof.add(phase, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count());
+		}
+	}
+};
+
 static void error_callback(int error, const char* description)
 {
 	fprintf(stderr, "Error: %s\n", description);
@@ -124,6 +982,11 @@ static void error_callback(int error, const char* description)
 
 void quit(GLFWwindow *window)
 {
+	prof.finish();
+	trace.write(TRACEFILE);
+	shaderwatch.finish();
+	jobs.finish();
+	gpumem.shutdown();
 	glfwDestroyWindow(window);
 	glfwTerminate();
 	exit(EXIT_SUCCESS);
@@ -150,22 +1013,22 @@ glm::vec3 getRGBfromHue (int hue)
 }
 
 /* Generate VAO, VBOs and return VAO handle */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+/* GL objects come from gpumem and go back to it when the handle is released */
+bool HEADLESS=false;     //set by bench.cpp when there is no GL context, objects get no GPU buffers
+vaohandle create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
 {
-	struct VAO* vao = new struct VAO;
+	if(HEADLESS)return vaohandle();      //no context, physics only
+	struct VAO* vao = gpumem.getvao();
 	vao->PrimitiveMode = primitive_mode;
 	vao->NumVertices = numVertices;
 	vao->FillMode = fill_mode;
 
 	// Create Vertex Array Object
 	// Should be done after CreateWindow and before any other GL calls
-	glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
-	glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-	glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
+	vao->VertexArrayID = gpumem.getarray(); // VAO
 
 	glBindVertexArray (vao->VertexArrayID); // Bind the VAO 
-	glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
-	glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
+	vao->VertexBuffer = gpumem.getbuffer(3*numVertices*sizeof(GLfloat), vertex_buffer_data, vao->VertexBytes); // VBO - vertices, bound with data copied
 	glVertexAttribPointer(
 			0,                  // attribute 0. Vertices
 			3,                  // size (x,y,z)
@@ -175,8 +1038,7 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
 			(void*)0            // array buffer offset
 			);
 
-	glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors 
-	glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
+	vao->ColorBuffer = gpumem.getbuffer(3*numVertices*sizeof(GLfloat), color_buffer_data, vao->ColorBytes); // VBO - colors, bound with data copied
 	glVertexAttribPointer(
 			1,                  // attribute 1. Color
 			3,                  // size (r,g,b)
@@ -186,25 +1048,27 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
 			(void*)0            // array buffer offset
 			);
 
-	return vao;
+	return vaohandle(vao);
 }
 
 /* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
+vaohandle create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
 {
-	GLfloat* color_buffer_data = new GLfloat [3*numVertices];
+	vector<GLfloat> color_buffer_data(3*numVertices);
 	for (int i=0; i<numVertices; i++) {
 		color_buffer_data [3*i] = red;
 		color_buffer_data [3*i + 1] = green;
 		color_buffer_data [3*i + 2] = blue;
 	}
 
-	return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+	return create3DObject(primitive_mode, numVertices, vertex_buffer_data, &color_buffer_data[0], fill_mode);
 }
 
 /* Render the VBOs handled by VAO */
+long DRAWCALLS=0;        //draw3DObject calls so far, read by the offscreen benchmark
 void draw3DObject (struct VAO* vao)
 {
+	DRAWCALLS++;
 	// Change the Fill Mode for this object
 	glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
 
@@ -224,6 +1088,127 @@ void draw3DObject (struct VAO* vao)
 	// Draw the geometry !
 	glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
 }
+/* count copies of vao in one call, each moved and scaled by its own instance (attribute 2,
+   which only a VAO set up for instancing enables; for every other one it reads as 0,0,0,1) */
+void draw3DObjectInstanced (struct VAO* vao, int count)
+{
+	DRAWCALLS++;
+	glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+	glBindVertexArray (vao->VertexArrayID);
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+	glEnableVertexAttribArray(2);
+	glDrawArraysInstanced(vao->PrimitiveMode, 0, vao->NumVertices, count);
+}
+
+/* Stacked bars per frame in the lower left of the screen, 50 ms tall: cpu phases
+   on the left, gpu passes in the middle, input latency on the right */
+void profiler::draw() {
+	static const float colors[ROWS][3] = {{0.0,0.8,0.8}, {0.2,0.8,0.2}, {0.9,0.6,0.1}, {0.9,0.2,0.9}, {0.2,0.5,1.0}, {0.9,0.9,0.2}, {0.6,0.6,0.6},
+		{0.94,0.67,0.4}, {0.7,0.1,0.0}, {1.0,0.0,0.0}, {0.0,0.6,1.0}, {1.0,1.0,1.0}, {0.55,0.4,0.25},
+		{1.0,0.4,0.7}};
+	const int MAXFLOATS = (FRAMES * ROWS + 6) * 18;
+	GLintptr offset;                 // positions, then as many colors
+	GLfloat * vbd = (GLfloat *) vertexstream.alloc(2 * MAXFLOATS * sizeof(GLfloat), offset);
+	if(!vbd)
+		return;
+	GLfloat * cbd = vbd + MAXFLOATS;
+	int k = 0;
+	for(int i = 0; i < count; ++i){
+		int f = (frame - count + i + FRAMES) % FRAMES;
+		float y = 0, gy = 0;
+		for(int r = 0; r < ROWS; ++r){
+			float x = i, h = times[r][f], base = y;
+			if(r == FRAMEROW)              // part of the frame outside all phases
+				h = max(0.0f, times[r][f] - y);
+			if(r == LATENCYROW)
+				x += 2 * (FRAMES + 8), base = 0;
+			else if(r >= GPUROW)
+				x += FRAMES + 8, base = gy, gy += h;
+			else y += h;
+			float quad[] = {x,base,0, x+1,base,0, x+1,base+h,0, x+1,base+h,0, x,base,0, x,base+h,0};
+			for(int j = 0; j < 18; ++j)vbd[k + j] = quad[j], cbd[k + j] = colors[r][j % 3];
+			k += 18;
+		}
+	}
+	float marks[] = {1000.0f / 60, 1000.0f / 30};  // 60 and 30 fps lines
+	for(int g = 0; g < 3; ++g){
+		float x0 = g * (FRAMES + 8), x1 = x0 + FRAMES;
+		for(int m = 0; m < 2; ++m){
+			float y = marks[m];
+			float quad[] = {x0,y,0, x1,y,0, x1,y+0.3f,0, x1,y+0.3f,0, x0,y,0, x0,y+0.3f,0};
+			for(int j = 0; j < 18; ++j)vbd[k + j] = quad[j], cbd[k + j] = 1;
+			k += 18;
+		}
+	}
+	vertexstream.commit();
+	if(!graph){
+		glGenVertexArrays(1, &graph);
+		glBindVertexArray(graph);
+		glEnableVertexAttribArray(0);
+		glEnableVertexAttribArray(1);
+	}
+	glBindVertexArray(graph);
+	glBindBuffer(GL_ARRAY_BUFFER, vertexstream.buffer);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void *) offset);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, (void *) (offset + MAXFLOATS * sizeof(GLfloat)));
+	glm::mat4 MVP = glm::ortho(0.0f, 4.0f * FRAMES, 0.0f, 200.0f, -1.0f, 1.0f);
+	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+	glDisable(GL_DEPTH_TEST);        // always on top of the scene
+	DRAWCALLS++;
+	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+	glDrawArrays(GL_TRIANGLES, 0, k / 3);
+	glEnable(GL_DEPTH_TEST);
+}
+
+/* GPU time per render pass from GL_TIME_ELAPSED queries. Results are read
+   LATENCY frames later and only if already available, so the CPU never waits */
+typedef struct gputimer{
+	enum { LATENCY = 3 };            // frames in flight
+	GLuint queries[LATENCY][GPUPASSES];
+	bool issued[LATENCY][GPUPASSES];
+	int frame = 0, active = -1;
+	void init() {
+		glGenQueries(LATENCY * GPUPASSES, &queries[0][0]);
+		for(int f = 0; f < LATENCY; ++f)
+			for(int p = 0; p < GPUPASSES; ++p)
+				issued[f][p] = false;
+	}
+	/* Starts timing pass, ending the previous one; passes can not nest */
+	void begin(int pass) {
+		end();
+		if(!PROFILING)
+			return;
+		glBeginQuery(GL_TIME_ELAPSED, queries[frame][pass]);
+		issued[frame][pass] = true;
+		active = pass;
+	}
+	void end() {
+		if(active == -1)
+			return;
+		glEndQuery(GL_TIME_ELAPSED);
+		active = -1;
+	}
+	/* Ends the frame's last pass, collects the oldest frame's results into the
+	   profiler and moves on to its queries */
+	void endframe() {
+		end();
+		frame = (frame + 1) % LATENCY;
+		for(int p = 0; p < GPUPASSES; ++p){
+			if(!issued[frame][p])
+				continue;
+			GLint available = 0;
+			glGetQueryObjectiv(queries[frame][p], GL_QUERY_RESULT_AVAILABLE, &available);
+			if(available){
+				GLuint64 ns = 0;
+				glGetQueryObjectui64v(queries[frame][p], GL_QUERY_RESULT, &ns);
+				prof.add(profiler::GPUROW + p, ns / 1e6);
+			}
+			issued[frame][p] = false;
+		}
+	}
+}gputimer;
+gputimer gputime;
 
 /**************************
  * Customizable functions *
@@ -237,18 +1222,29 @@ float tx,ty,ti=0,MAXHEIGHT=500;
 float s = 1;
 bool ballinsky=false;   //whether ball in sky
 float PANX = 0;
+float VIEWW=650,VIEWH=500;   //half extents of ortho view, set in reshapeWindow
 bool MANPAN=true,firsttime=true;
 int BALLCOUNT=0,LIFES=5;
 int SCORE=0,TARGETS=6;
 struct obstacle;
 obstacle *allobstacles;
 void translateTargets();
+int OFFSCREEN=0;         //frames to render without a window (--offscreen N)
+bool SIMULATE=false;     //--simulate, sweep the cannon through its range headless
+int STRESS=0;            //obstacles in the generated stress level (--stress N)
+double SIMCLOCK=-1;      //fixed simulation clock for headless runs, wall clock when <0
+double gametime(){
+	return SIMCLOCK>=0?SIMCLOCK:glfwGetTime();
+}
+bool inview(float x,float y,float hw,float hh){    //AABB centred at x,y overlaps current view
+	return x+hw>=PANX-VIEWW&&x-hw<=PANX+VIEWW&&y+hh>=-VIEWH&&y-hh<=VIEWH;
+}
 typedef struct color{
 	float r,g,b;
 	color(float r,float g,float b):
 	r(r),g(g),b(b) {}
 }color;
-VAO* createCircle(float r,color c){
+vaohandle createCircle(float r,color c){
 	static GLfloat vbd[7000];
 	static GLfloat cbd[7000];
 	float px=0,py=0,cx=0,cy=0,i;
@@ -274,7 +1270,7 @@ void drawCircle(VAO* circle,float x,float y){
 	glUniformMatrix4fv(Matrices.MatrixID,1,GL_FALSE,&MVP[0][0]);
 	draw3DObject(circle);
 }
-VAO* createRectangle(int w,int h,color c){
+vaohandle createRectangle(int w,int h,color c){
 	GLfloat vbd[]={
 		-w/2.0,-h/2.0,0,
 		w/2.0,-h/2.0,0,
@@ -294,38 +1290,79 @@ VAO* createRectangle(int w,int h,color c){
 		c.r,c.g,c.b	};
 	return create3DObject(GL_TRIANGLES,6,vbd,cbd,GL_FILL);
 }
+/* Collision response. (nx,ny) is the unit contact normal pointing out of the
+   surface: the normal part of the velocity is reversed and scaled by the
+   restitution e, and friction takes up to mu times that impulse off the
+   tangential part. Returns false when the ball is already moving away */
+const double GRAVITY=200;          //ball::fire, vely = vely_in - 200*t
+const float GROUNDBOUNCE=0.8,GROUNDFRICTION=0.3;
+const float BLOCKBOUNCE=0.6,BLOCKFRICTION=0.2;
+const float RESTSPEED=30;          //rebounds slower than this (about 2 px high) stay in contact and slide
+const float SLEEPTIME=0.3;         //stopped this long on its support,a ball goes to sleep
+const float BALLDENSITY=4;         //blocks have density 1,so a ball weighs about as much as four small blocks
+const float SLEEPLINEAR=5,SLEEPANGULAR=0.05;    //px/s and rad/s,slower bodies may sleep
+bool impulse(float &vx,float &vy,float nx,float ny,float e,float mu){
+	float vn=vx*nx+vy*ny;
+	if(vn>=0)return false;
+	float vt=vy*nx-vx*ny;              //along the tangent (-ny,nx)
+	float jn=-(1+e)*vn,jt=-vt;
+	jt=max(-mu*jn,min(mu*jn,jt));
+	vx+=jn*nx-jt*ny;
+	vy+=jn*ny+jt*nx;
+	return true;
+}
+/* Outward normal of the box centred at cx,cy with half sizes hw,hh, at the
+   point nearest to px,py. From inside, the face with the least penetration */
+void boxNormal(float px,float py,float cx,float cy,float hw,float hh,float &nx,float &ny){
+	float dx=px-cx,dy=py-cy;
+	float ex=dx-max(-hw,min(hw,dx)),ey=dy-max(-hh,min(hh,dy));
+	float d=sqrt(ex*ex+ey*ey);
+	if(d>1e-6)nx=ex/d,ny=ey/d;
+	else if(hw-fabs(dx)<hh-fabs(dy))nx=dx<0?-1:1,ny=0;
+	else nx=0,ny=dy<0?-1:1;
+}
 typedef struct ball{
 	float stx,sty;
 	float sx,sy,x,y,vel,velx,vely,lu,st;
 	float r,k,velx_in,vely_in;
 	float rang,rs;
 	bool isshoot,collision_obj,collision_ground,falling,power,shootpower;
-	VAO *circle;
-	GLfloat vbd[7000];
-	GLfloat cbd[7000];
+	vaohandle circle;      //none for split fragments,see fragmentpool
 	glm::mat4 project;
 	glm::mat4 translate;
+	glm::mat4 model;
+	bool placed=false;     //set by place(), consumed by draw()
+	enum { FLYING=-2, GROUNDED=-1 };
+	int support=FLYING;    //what it rests on: FLYING,GROUNDED or an obstacle index
+	float mu;              //friction of the support
+	bool asleep=false;     //at rest,left out of step() until shot again
+	int touching=-1;       //obstacle hit and not yet left,see clearcollisions
 	void init(){
 		s=1;
 		PANX=0;
 		BALLCOUNT++;
 		project = glm::mat4(1.0f);
 		translate = glm::mat4(1.0f);
-		ballinsky=isshoot=collision_ground=collision_obj=falling=power=false;
+		ballinsky=isshoot=collision_ground=collision_obj=falling=power=asleep=false;
+		support=FLYING,touching=-1;
 		MANPAN=shootpower=true;
 		sx=sy=0;
 		vel = 400;
 		k=1.01;
 	} 
-	void create(color c){
+	void reset(){           //state of a new ball,without its mesh
 		project = glm::mat4(1.0f);
 		translate = glm::mat4(1.0f);
-		collision_ground=collision_obj=falling=power=false;
+		isshoot=collision_ground=collision_obj=falling=power=asleep=placed=false;
+		support=FLYING,touching=-1;
 		shootpower=true;
 		sx=sy=0;
 		vel = 400;
 		k=1.01;
 		//k=1+0.01/2.0;  //change k acc. to spring length
+	}
+	void create(color c){
+		reset();
 		circle = createCircle(r,c);
 		return;	
 	}
@@ -333,10 +1370,7 @@ typedef struct ball{
 		//printf("y: %f is:%d\n",y,isshoot);
 		return y<=-300&&isshoot;
 	}
-	void draw(float nx,float ny,float s){
-		glm::mat4 MVP;
-		glm::mat4 VP = Matrices.projection * Matrices.view;
-		Matrices.model = glm::mat4(1.0f);
+	void place(float nx,float ny,float s){    //update model matrix and centre, no GL calls
 		if(!isshoot){
 			project = glm::mat4(1.0f);
 			rang = pipe_rot*M_PI/180.0f;
@@ -345,8 +1379,8 @@ typedef struct ball{
 		glm::mat4 translateBall = translate*glm::translate(glm::vec3(nx,ny*rs,0));
 		glm::mat4 rotateBall = glm::rotate((float)(rang),glm::vec3(0,0,1));
 		glm::mat4 translateBallagain = glm::translate (glm::vec3(-3.5*0.9*115,-3*0.9*115,0));
-		Matrices.model*=(project*translateBallagain*rotateBall*translateBall);
-		float *mv = (&Matrices.model[0][0]);
+		model = project*translateBallagain*rotateBall*translateBall;
+		float *mv = (&model[0][0]);
 		x =  mv[12];
 		y =  mv[13];
 		float z =  mv[14];
@@ -367,13 +1401,22 @@ typedef struct ball{
 		// 	sx=sy=0;
 		// 	return;
 		// }
-		MVP = VP*Matrices.model;
-		glUniformMatrix4fv(Matrices.MatrixID,1,GL_FALSE,&MVP[0][0]);
 		//x=nx,y=ny;
 //		printf("x:%f y:%f\n",x,y);
 		if(x>600){                        //to handle screen panning before drawing ball
 			PANX=x-650+100;
 		}
+		placed=true;
+	}
+	void draw(){
+		if(!placed)return;                //not placed this frame (e.g. just reset)
+		placed=asleep;                    //a sleeping ball stays where it is
+		if(!inview(x,y,r,r))return;       //off-screen, position already updated
+		glm::mat4 MVP;
+		glm::mat4 VP = Matrices.projection * Matrices.view;
+		Matrices.model = model;
+		MVP = VP*Matrices.model;
+		glUniformMatrix4fv(Matrices.MatrixID,1,GL_FALSE,&MVP[0][0]);
 		draw3DObject(circle);	
 	}
 	void shoot(float ang){
@@ -387,9 +1430,10 @@ typedef struct ball{
 		//ang = 0.5*M_PI - ang;
 		//float vel = 500;
 		//printf("shooted vel:%f\n",vel);
-		st = glfwGetTime();
-		lu=glfwGetTime();
+		st = gametime();
+		lu=gametime();
 		isshoot=ballinsky=true;
+		support=FLYING,asleep=false;
 		//sx=x,sy=y;
 		MAXHEIGHT+=abs(sty);
 		maxh = (vel*sin(ang))*(vel*sin(ang))/400.f;
@@ -399,37 +1443,63 @@ typedef struct ball{
 		velx=velx_in=vel*cos(ang),vely=vely_in=vel*sin(ang);
 		//printf("in shoot velx:%f vely:%f\n",velx,vely);
 	}
+	void relaunch(float vx,float vy){   //new parabola from where the ball is,after a collision
+		sx=x-stx,sy=y-sty;
+		st=lu=gametime();
+		velx=velx_in=vx,vely=vely_in=vy;
+		vel=sqrt(vx*vx+vy*vy);
+		falling=vy<=0;
+	}
+	bool active(){                      //in flight or sliding
+		return isshoot&&!asleep;
+	}
+	bool outside(){                     //left the window,the shot is over
+		return x>=1300||x<-650;
+	}
+	void land(int on,float top,float friction){    //resting contact,slides at height top until friction stops it
+		y=top;
+		relaunch(velx,0);
+		support=on,mu=friction;
+	}
+	void takeoff(){                     //support moved or ran out,falls from here
+		support=FLYING;
+		relaunch(velx,0);
+	}
 	void fire(float s){
-		if(x>=1300||x<-650){       //ball out of window
+		TRACE("ball::fire");
+		if(outside()){             //ball out of window
 			init();
 			return;
 		}
 		float nx,ny;
 		float ct;
-		ti = glfwGetTime();
-		if(ti-lu>=10e-10){
+		ti = gametime();
+		if(ti-lu>=0){               //also right after shoot() on a fixed clock,so falling follows the new velocity
 			ti-=st;
 			//printf("sx: %f sy: %f\n",sx,sy);
-			if(isshoot&&abs(velx-0.0)<=(float)10e-10&&velx<=0){    //ball came to rest (Important buggy not coming to rest on top of an obstacle)
-				//printf("at rest in fire\n");
-				init();
-				// isshoot=ballinsky=false;
-				// sx=sy=0;
-				return;
+			if(support!=FLYING){       //sliding,friction decelerates it to a stop
+				float a=mu*GRAVITY,stop=fabs(velx_in)/a,u=min(ti,stop),dir=velx_in<0?-1:1;
+				nx=sx+velx_in*u-dir*a*u*u/2;
+				ny=sy;
+				velx=velx_in-dir*a*u,vely=0;
+				falling=false;
+				if(ti-stop>=SLEEPTIME)asleep=true;
 			}
-			nx = sx+velx_in*ti;
-			ny=sy+vely_in*ti-100*ti*ti;
-			lu=glfwGetTime();
-			vely = vely_in - 200*ti;
+			else{
+				nx = sx+velx_in*ti;
+				ny=sy+vely_in*ti-100*ti*ti;
+				vely = vely_in - 200*ti;
+				if(vely<=0)falling=true;
+				else falling = false;
+			}
+			lu=gametime();
 			vel = sqrt(velx*velx +vely*vely);
-			if(vely<=0)falling=true;
-			else falling = false;
 			//printf("velx:%f vely:%f\n",velx,vely);
 		}
 		//ti+=0.1;
 		project = glm::translate(glm::vec3(nx,ny,0));
 		//vely-=0.01*ti;
-		draw(0,25+10+15,s);
+		place(0,25+10+15,s);
 	}
 
 	void move(float nx,float ny){
@@ -440,13 +1510,175 @@ typedef struct ball{
 	}
 } ball;
 
+typedef struct rng{              //xorshift64*, the same sequence on every platform
+	unsigned long long state;
+	rng(unsigned long long seed):state(seed*0x9E3779B97F4A7C15ULL|1) {}
+	unsigned long long next(){
+		state^=state>>12,state^=state<<25,state^=state>>27;
+		return state*0x2545F4914F6CDD1DULL;
+	}
+	float uniform(float lo,float hi){
+		return lo+(hi-lo)*(float)((next()>>40)/16777216.0);
+	}
+	int range(int lo,int hi){        //lo..hi inclusive
+		return lo+(int)(next()%(unsigned long long)(hi-lo+1));
+	}
+}rng;
+/* Debris and dust. A preallocated ring of particles kept as separate arrays
+   (structure of arrays) and integrated four at a time with SSE. Spawning writes
+   at head and overwrites the oldest when the ring is full; tail moves past the
+   ones that have expired, the rest are drawn and shrink to nothing as they die.
+   Every frame the live range is copied array by array into vertexstream and
+   drawn as one instanced quad */
+const int MAXPARTICLES=100000;         //a multiple of 4
+const float PARTICLESIZE=3;            //half width of a new particle
+const float PARTICLEFLOOR=-325,PARTICLEBOUNCE=0.3,PARTICLEFRICTION=0.6;
+const float PARTICLESTOP=1;            //px/s,slower on the ground it stops instead of decaying into denormals
+typedef struct particlesystem{
+	alignas(16) float x[MAXPARTICLES];
+	alignas(16) float y[MAXPARTICLES];
+	alignas(16) float vx[MAXPARTICLES];
+	alignas(16) float vy[MAXPARTICLES];
+	alignas(16) float life[MAXPARTICLES];    //seconds left
+	unsigned rgba[MAXPARTICLES];             //red in the low byte
+	long long head=0,tail=0;                 //spawned so far,oldest not yet expired; the slot is %MAXPARTICLES
+	double last=-1;                          //gametime of the last step
+	rng random=rng(1);
+	GLuint program=0,MatrixID=0,SizeID=0;
+	GLuint vao=0,quad=0;
+	void clear(){
+		head=tail=0,last=-1;
+		random=rng(1);
+	}
+	long long alive(){
+		return head-tail;
+	}
+	/* n particles from x,y at up to speed px/s, over the upper half circle when
+	   up is set (off a surface), all around otherwise */
+	void emit(float px,float py,float speed,bool up,color c,int n){
+		for(int k=0;k<n;++k){
+			if(head-tail==MAXPARTICLES)++tail;    //the oldest makes room
+			int i=head++%MAXPARTICLES;
+			float a=random.uniform(0,up?M_PI:2*M_PI),v=random.uniform(0.2,1)*speed,shade=random.uniform(0.7,1.1);
+			x[i]=px,y[i]=py;
+			vx[i]=v*cos(a),vy[i]=v*sin(a);
+			life[i]=random.uniform(0.5,1.2);
+			unsigned r=min(255.0f,c.r*shade*255),g=min(255.0f,c.g*shade*255),b=min(255.0f,c.b*shade*255);
+			rgba[i]=r|g<<8|b<<16|255u<<24;
+		}
+	}
+	/* Slots begin..end (multiples of 4) through dt: gravity as for the balls,
+	   and a particle that falls through the ground comes back up slower and
+	   loses some of its sideways speed */
+	void integrate(int begin,int end,float dt){
+#ifdef __SSE__
+		__m128 t=_mm_set1_ps(dt),g=_mm_set1_ps(GRAVITY*dt),ground=_mm_set1_ps(PARTICLEFLOOR);
+		__m128 bounce=_mm_set1_ps(-PARTICLEBOUNCE),friction=_mm_set1_ps(PARTICLEFRICTION);
+		__m128 stop=_mm_set1_ps(PARTICLESTOP),sign=_mm_set1_ps(-0.0f);
+		for(int i=begin;i<end;i+=4){
+			__m128 nvx=_mm_load_ps(vx+i),nvy=_mm_sub_ps(_mm_load_ps(vy+i),g);
+			__m128 nx=_mm_add_ps(_mm_load_ps(x+i),_mm_mul_ps(nvx,t));
+			__m128 ny=_mm_add_ps(_mm_load_ps(y+i),_mm_mul_ps(nvy,t));
+			__m128 below=_mm_cmplt_ps(ny,ground);
+			nvy=_mm_or_ps(_mm_and_ps(below,_mm_mul_ps(nvy,bounce)),_mm_andnot_ps(below,nvy));
+			__m128 slid=_mm_mul_ps(nvx,friction);
+			slid=_mm_and_ps(slid,_mm_cmpge_ps(_mm_andnot_ps(sign,slid),stop));
+			nvx=_mm_or_ps(_mm_and_ps(below,slid),_mm_andnot_ps(below,nvx));
+			_mm_store_ps(x+i,nx),_mm_store_ps(y+i,_mm_max_ps(ny,ground));
+			_mm_store_ps(vx+i,nvx),_mm_store_ps(vy+i,nvy);
+			_mm_store_ps(life+i,_mm_sub_ps(_mm_load_ps(life+i),t));
+		}
+#else
+		for(int i=begin;i<end;++i){
+			vy[i]-=GRAVITY*dt;
+			x[i]+=vx[i]*dt,y[i]+=vy[i]*dt;
+			if(y[i]<PARTICLEFLOOR){
+				y[i]=PARTICLEFLOOR,vy[i]*=-PARTICLEBOUNCE,vx[i]*=PARTICLEFRICTION;
+				if(fabs(vx[i])<PARTICLESTOP)vx[i]=0;
+			}
+			life[i]-=dt;
+		}
+#endif
+	}
+	/* Every live particle through dt, in blocks of four slots across the jobs */
+	void advance(float dt){
+		while(tail<head&&life[tail%MAXPARTICLES]<=0)++tail;
+		if(tail==head)return;
+		long long first=tail&~3LL;
+		int blocks=min((head-first+3)/4,(long long)MAXPARTICLES/4);   //the whole ring at most,each slot once
+		jobs.parallelFor(blocks,4096,[&](int begin,int end){
+			int i=(first+4LL*begin)%MAXPARTICLES,n=4*(end-begin),run=min(n,MAXPARTICLES-i);
+			integrate(i,i+run,dt);
+			if(run<n)integrate(0,n-run,dt);                //wrapped around the ring
+		});
+	}
+	void step(){
+		TRACE("particles");
+		double now=gametime();
+		if(last>=0&&now>last)advance(min(now-last,0.1));
+		last=now;
+	}
+	/* The quad. Made once: the VAO has the per-particle attributes 2 to 5 enabled */
+	void create(){
+		if(vao||HEADLESS)return;
+		static const GLfloat corners[]={-1,-1, 1,-1, -1,1, 1,1};
+		glGenVertexArrays(1,&vao);
+		glBindVertexArray(vao);
+		glGenBuffers(1,&quad);
+		glBindBuffer(GL_ARRAY_BUFFER,quad);
+		glBufferData(GL_ARRAY_BUFFER,sizeof(corners),corners,GL_STATIC_DRAW);
+		glVertexAttribPointer(0,2,GL_FLOAT,GL_FALSE,0,(void*)0);
+		glEnableVertexAttribArray(0);
+		for(int a=2;a<=5;++a){
+			glEnableVertexAttribArray(a);
+			glVertexAttribDivisor(a,1);
+		}
+	}
+	/* Copy the live range, oldest first, into this frame's vertexstream and
+	   point the attributes at it. Returns the count */
+	int upload(){
+		int n=head-tail,i=tail%MAXPARTICLES,run=min(n,MAXPARTICLES-i);
+		if(!n||!vao)return 0;
+		TRACE("particles upload");
+		GLintptr base;
+		GLsizeiptr bytes=n*sizeof(float);        //per array
+		char *p=vertexstream.alloc(4*bytes,base);
+		if(!p)return 0;
+		const void *arrays[4]={x,y,life,rgba};
+		for(int a=0;a<4;++a){
+			memcpy(p+a*bytes,(const char*)arrays[a]+i*sizeof(float),run*sizeof(float));
+			memcpy(p+a*bytes+run*sizeof(float),arrays[a],(n-run)*sizeof(float));
+		}
+		vertexstream.commit();
+		glBindVertexArray(vao);
+		glBindBuffer(GL_ARRAY_BUFFER,vertexstream.buffer);
+		for(int a=0;a<3;++a)
+			glVertexAttribPointer(2+a,1,GL_FLOAT,GL_FALSE,0,(void*)(base+a*bytes));
+		glVertexAttribPointer(5,4,GL_UNSIGNED_BYTE,GL_TRUE,0,(void*)(base+3*bytes));
+		return n;
+	}
+	void draw(){
+		int n=upload();
+		if(!n||!program)return;
+		DRAWCALLS++;
+		glm::mat4 MVP = Matrices.projection * Matrices.view;
+		glUseProgram(program);
+		glUniformMatrix4fv(MatrixID,1,GL_FALSE,&MVP[0][0]);
+		glUniform1f(SizeID,PARTICLESIZE);
+		glPolygonMode(GL_FRONT_AND_BACK,GL_FILL);
+		glDrawArraysInstanced(GL_TRIANGLE_STRIP,0,4,n);
+		glUseProgram(programID);
+	}
+}particlesystem;
+particlesystem particles;
+const color TARGETCOLOR(0.9607,0.5529,0.1137);
+const color DEBRIS=TARGETCOLOR,DUST(0.55,0.4,0.25);    //dust darker than the ground
+
 typedef struct ground
 {	
-	double lasttime;
-	VAO *shape;
+	GLfloat vbd[18],cbd[18];     //drawn as part of staticlayer
 	void create(){
-		lasttime = double(-10e5);
-		GLfloat vbd[]={
+		GLfloat quad[]={
 			-650,-500,0,
 			1300,-500,0,
 			1300,-100,0,
@@ -455,7 +1687,7 @@ typedef struct ground
 			-650,-500,0,
 			-650,-100,0
 		};
-		GLfloat cbd[]={
+		GLfloat colors[]={
 			0.94,0.67,0.4,
 			0.94,0.67,0.4,
 			0.94,0.67,0.4,
@@ -464,41 +1696,25 @@ typedef struct ground
 			0.94,0.67,0.4,
 			0.94,0.67,0.4
 		};
-		shape = create3DObject(GL_TRIANGLES,6,vbd,cbd,GL_FILL);
-	}
-	void draw(){
-		glm::mat4 MVP;
-		glm::mat4 VP = Matrices.projection * Matrices.view;
-		Matrices.model = glm::mat4(1.0f);
-		MVP = VP*Matrices.model;
-		glUniformMatrix4fv(Matrices.MatrixID,1,GL_FALSE,&MVP[0][0]);
-		draw3DObject(shape);
+		memcpy(vbd,quad,sizeof(vbd)),memcpy(cbd,colors,sizeof(cbd));
 	}
 	void checkCollision(ball &b){
-		float alpha=0.8,ang,beta=0.8;
-		if(b.onground()&&b.falling&&!b.collision_ground){
-			//printf("delta %lf\n",glfwGetTime()-lasttime );
-			if(abs(b.velx-0.0)<=(double)10e-18&&b.velx<=0||(glfwGetTime()-lasttime<=0.5)||(b.velx<=0&&abs(b.velx)<=0.1&&b.vely<0&&abs(b.vely)>=10)){    //ball came to rest (if time diff b/w two arrivals <=0.5 init())
-				b.init();
-				s=1;
-				return;
-			}
-			lasttime=glfwGetTime();
+		if(b.onground()&&b.falling&&!b.collision_ground&&b.support==ball::FLYING){
 			//printf("collided ground x:%f y:%f \n",b.x,b.y);
-			b.collision_ground=b.falling=true;
-			b.sx=b.x-b.stx,b.sy=b.y-b.sty;
-			b.vel = sqrt((beta*beta*b.velx*b.velx + alpha*alpha*b.vely*b.vely));  //alpha of collision = 1/600
-			if(b.velx>0)ang = atan(-1*alpha*b.vely/b.velx*beta);
-			else ang = M_PI/2.0 + atan(abs(b.velx*beta)/abs(alpha*b.vely));
-			b.shoot(ang);  //angle is hard-coded for test
+			b.collision_ground=true;
+			float vx=b.velx,vy=b.vely;
+			impulse(vx,vy,0,1,GROUNDBOUNCE,GROUNDFRICTION);
+			particles.emit(b.x,b.y-b.r,vy,true,DUST,min(60,(int)(vy/5)));    //the harder the bounce,the more dust
+			b.relaunch(vx,vy);
+			if(vy<RESTSPEED)b.land(ball::GROUNDED,-300,GROUNDFRICTION);
 		}
 	}
 
 }ground;
 typedef struct sky{
-	VAO *shape;
+	GLfloat vbd[18],cbd[18];     //drawn as part of staticlayer
 	void create(){
-		GLfloat vbd[]={
+		GLfloat quad[]={
 			-650,-100,0,
 			1300,-100,0,
 			1300,500,0,
@@ -507,7 +1723,7 @@ typedef struct sky{
 			-650,-100,0,
 			-650,500,0
 		};
-		GLfloat cbd[]={
+		GLfloat colors[]={
 			0,0,0.1,
 			0,0,0.1,
 			0,0,0.1,
@@ -516,29 +1732,34 @@ typedef struct sky{
 			0,0,0.1,
 			0,0,0.1
 		};
-		shape = create3DObject(GL_TRIANGLES,6,vbd,cbd,GL_FILL);
-	}
-	void draw(){
-		glm::mat4 MVP;
-		glm::mat4 VP = Matrices.projection * Matrices.view;
-		Matrices.model = glm::mat4(1.0f);
-		MVP = VP*Matrices.model;
-		glUniformMatrix4fv(Matrices.MatrixID,1,GL_FALSE,&MVP[0][0]);
-		draw3DObject(shape);
+		memcpy(vbd,quad,sizeof(vbd)),memcpy(cbd,colors,sizeof(cbd));
 	}
 }sky;
 typedef struct obstacle
-{	VAO* shape;
-	glm::mat4 translate,translateagain,scale;
+{	vaohandle shape;
+	glm::mat4 translate,translateagain,scale,model;
 	float w,h;   //width and height
 	float x,y,r; 
 	bool circle;     //whether circle
-	bool collision,dir,target,available;
+	color tint=color(0,0,0);
+	bool dir,target,available;
 	int numhit;  //no. of times hitted 
+	float speed;           //moving walls go up and down by speed each frame,0 is static
+	float restx,resty;     //targets rest on a floor at this point
+	int floor;             //targets: the floor they ride on,-1 none
+	float offx;            //targets: distance along that floor from its centre
+	bool dynamic,awake;    //rigid body (blocks and floors),see stepBodies
+	float angle,velx,vely,spin;       //radians,px/s,rad/s
+	float pushx,pushy,pushspin;       //removes overlap this step only,adds no energy
+	float invmass,invinertia,still;   //still: time spent slow enough to sleep
 	void create(int wi,int he,color c,bool cir,bool tar){
 		available=dir=true;
-		circle=cir,target=tar;
-		collision=false;
+		speed=restx=resty=0;
+		floor=-1,offx=0;
+		dynamic=awake=false;
+		angle=velx=vely=spin=invmass=invinertia=still=0;
+		pushx=pushy=pushspin=0;
+		circle=cir,target=tar,tint=c;
 		translateagain=scale=glm::mat4(1.0f);
 		translate=glm::mat4(1.0f);
 		x=y=0;
@@ -554,62 +1775,103 @@ typedef struct obstacle
 			shape = createCircle(r,c);
 		}
 	}
+	void update(){          //recompute model matrix and centre,needed for collisions even when not drawn
+		if(dynamic)translate = glm::translate(glm::vec3(x,y,0))*glm::rotate(angle,glm::vec3(0,0,1));
+		model = translateagain*translate*scale;
+		float *mv = (&model[0][0]);
+		x =  mv[12]/mv[15];
+		y =  mv[13]/mv[15];
+	}
+	void makeDynamic(){     //density 1,starts asleep
+		update();
+		dynamic=true;
+		invmass=1.0/(w*h);
+		invinertia=12.0/(w*h*(w*w+h*h));
+	}
+	void wake(){
+		if(dynamic&&!awake)awake=true,still=0;
+	}
+	void local(float px,float py,float &lx,float &ly){    //point in the box's own frame
+		float dx=px-x,dy=py-y;
+		if(angle==0){
+			lx=dx,ly=dy;
+			return;
+		}
+		float c=cos(angle),s=sin(angle);
+		lx=c*dx+s*dy,ly=-s*dx+c*dy;
+	}
+	void extent(float &hw,float &hh){    //half sizes of the axis aligned bounds
+		if(circle){
+			hw=hh=r;
+			return;
+		}
+		float c=fabs(cos(angle)),s=fabs(sin(angle));
+		hw=c*w/2.0+s*h/2.0,hh=s*w/2.0+c*h/2.0;
+	}
+	bool visible(){
+		float hw,hh;
+		extent(hw,hh);
+		return inview(x,y,hw,hh);
+	}
 	void draw(){
 		glm::mat4 MVP;
 		glm::mat4 VP = Matrices.projection * Matrices.view;
-		Matrices.model = glm::mat4(1.0f);
-		 //= glm::translate(glm::vec3(500,-300,0));
-		Matrices.model*=(translateagain*translate*scale);
-		float *mv = (&Matrices.model[0][0]);
-		x =  mv[12];
-		y =  mv[13];
-		float z =  mv[14];
-		float wp =  mv[15];
-
-		x /= wp;
-		y /= wp;
-		z /= wp;
+		Matrices.model = model;
 		MVP = VP*Matrices.model;
 		glUniformMatrix4fv(Matrices.MatrixID,1,GL_FALSE,&MVP[0][0]);
 		draw3DObject(shape);
 	}
 	
+	/* Its two triangles in world space,as createRectangle and transformed by
+	   model: 18 floats of position to p and as many of colour to c */
+	void corners(GLfloat *p,GLfloat *c){
+		float hw=w/2.0,hh=h/2.0;
+		float corner[]={-hw,-hh, hw,-hh, hw,hh, hw,hh, -hw,-hh, -hw,hh};
+		for(int k=0;k<6;++k){
+			glm::vec4 v=model*glm::vec4(corner[2*k],corner[2*k+1],0,1);
+			p[3*k]=v.x,p[3*k+1]=v.y,p[3*k+2]=0;
+			c[3*k]=tint.r,c[3*k+1]=tint.g,c[3*k+2]=tint.b;
+		}
+	}
 	void checkCollision(ball &b){
-		float delta=10.0,alpha;
-		if(b.x>=x-w/2.0-b.r-delta&&b.x<=x+w/2.0+b.r+delta&&b.y>=y-h/2.0-b.r-delta&&b.y<=y+h/2.0+b.r+delta&&!collision&&b.isshoot){
-			if(abs(b.velx-0.0)<=(double)10e-18&&b.velx<=0||(b.velx<=0&&abs(b.velx)<=0.1&&b.vely<0&&abs(b.vely)>=10)){
-				return;
-			}
-			float ang;
-			//printf("obscollided x:%f y:%f ang:%f\n",b.x,b.y,atan(b.vely/b.velx));
-			collision=true;
-			for(int i=0;i<2;++i){
-				if(allobstacles[i].x!=x&&allobstacles[i].y!=y){
-					allobstacles[i].collision=false;            //set collision with other obstacles as false
-			//		printf("entered %f %f\n",x,y);
-				}
-			}
-			b.sx=b.x-b.stx,b.sy=b.y-b.sty;
-			if(b.x<=x-w/2.0){                     //left
-			//	printf("left velx:%f vely:%f\n",b.velx,b.vely);
-				float tmp = atan(b.velx/abs(b.vely));
-				ang = M_PI/2.0 + tmp;
-				if(b.vely<0)ang*=-1.0;
-			}
-			else if(b.vely>0){
-			//	printf("bottom velx:%f vely:%f\n",b.velx,b.vely);
-				ang = -1.0*atan(b.vely/b.velx);
-				//ang = -1.0*M_PI/4.0;
+		float delta=10.0,lx,ly;
+		int i=this-allobstacles;
+		if(b.support==i||b.touching==i)return;        //resting on it,or already hit
+		local(b.x,b.y,lx,ly);
+		if(fabs(lx)<=w/2.0+b.r+delta&&fabs(ly)<=h/2.0+b.r+delta&&b.isshoot){
+			//printf("obscollided x:%f y:%f\n",b.x,b.y);
+			b.touching=i;                                  //once,until the ball leaves it
+			float nx,ny,vx=b.velx,vy=b.vely,c=cos(angle),s=sin(angle);
+			boxNormal(lx,ly,0,0,w/2.0,h/2.0,nx,ny);     //any face or corner
+			float wx=c*nx-s*ny,wy=s*nx+c*ny;
+			if(dynamic){
+				if(!push(b,wx,wy,vx,vy))return;
 			}
-			else if(b.vely<0){
-			//	printf("top collision\n");
-				ang = atan(abs(b.vely)/b.velx);
-			}
-			b.vel = (b.velx*b.velx + b.vely*b.vely)/600;
-			b.shoot(ang);
+			else if(!impulse(vx,vy,wx,wy,BLOCKBOUNCE,BLOCKFRICTION))return;
+			b.relaunch(vx,vy);
+			if(wy>0.99&&speed==0&&!awake&&vy<RESTSPEED)b.land(i,y+h/2.0+b.r,BLOCKFRICTION);   //on top
 		}
 	}
-	void hit(ball b){
+	/* Ball against this rigid body: impulse() with both of them moving. A
+	   sleeping body only wakes if the knock would get it moving */
+	bool push(ball &b,float nx,float ny,float &vx,float &vy){
+		float px=b.x-nx*b.r,py=b.y-ny*b.r,rx=px-x,ry=py-y;    //contact point,from the centre
+		float dvx=vx-(velx-spin*ry),dvy=vy-(vely+spin*rx);
+		float vn=dvx*nx+dvy*ny;
+		if(vn>=0)return false;
+		float ballinv=1/(BALLDENSITY*M_PI*b.r*b.r),rn=rx*ny-ry*nx,rt=rx*nx+ry*ny;
+		float jn=-(1+BLOCKBOUNCE)*vn/(ballinv+invmass+invinertia*rn*rn);
+		float vt=dvy*nx-dvx*ny;                     //along the tangent (-ny,nx)
+		float jt=-vt/(ballinv+invmass+invinertia*rt*rt);
+		jt=max(-BLOCKFRICTION*jn,min(BLOCKFRICTION*jn,jt));
+		float Px=jn*nx-jt*ny,Py=jn*ny+jt*nx,dspin=(rx*Py-ry*Px)*invinertia;
+		vx+=Px*ballinv,vy+=Py*ballinv;
+		if(!awake&&sqrt(Px*Px+Py*Py)*invmass<SLEEPLINEAR&&fabs(dspin)<SLEEPANGULAR)return true;
+		wake();
+		velx-=Px*invmass,vely-=Py*invmass,spin-=dspin;
+		return true;
+	}
+	void hit(ball &b){
 		float d = sqrt((b.x-x)*(b.x-x) + (b.y-y)*(b.y-y));
 		float s=0.5;
 		if(d<=r+b.r&&available){
@@ -618,15 +1880,18 @@ typedef struct obstacle
 				scale = glm::scale(glm::vec3(s,s,0));
 				r*=s;
 				SCORE+=10;
+				particles.emit(x,y,150,false,DEBRIS,40);
 			}
 			else if(numhit!=BALLCOUNT){
 				available=false;
 				SCORE+=10;
 				TARGETS--;
+				particles.emit(x,y,250,false,DEBRIS,150);
 			}
 		}	
 	}
 	void move(float vel){
+		TRACE("obstacle::move");
 		float nx,ny,MAXH=200,MINH=-200;
 		
 		if(!dir){
@@ -653,7 +1918,7 @@ typedef struct power{       //singleton,only one instance needed
 	float inx,iny,inti;  //parameters to be set when ball clicked(or power fired)
 	bool available;
 	int type;       //1-fire 2-speedup
-	VAO *circle;
+	vaohandle circle;
 	GLfloat vbd[7000];
 	GLfloat cbd[7000];
 	glm::mat4 translate;
@@ -664,15 +1929,11 @@ typedef struct power{       //singleton,only one instance needed
 		circle = createCircle(r,color(0,0,0));
 		return;	
 	}
-	void draw(){
+	void place(){
 		if(!available)return;
-		float ti = glfwGetTime()-inti;
-		glm::mat4 MVP;
-		glm::mat4 VP = Matrices.projection * Matrices.view;
-		Matrices.model = glm::mat4(1.0f);
+		float ti = gametime()-inti;
 		translate = glm::translate(glm::vec3(inx,iny-100.0*ti*ti,0));
-		Matrices.model*=translate;
-		float *mv = (&Matrices.model[0][0]);
+		float *mv = (&translate[0][0]);
 		x =  mv[12];
 		y =  mv[13];
 		float z =  mv[14];
@@ -681,6 +1942,13 @@ typedef struct power{       //singleton,only one instance needed
 		x /= wp;
 		y /= wp;
 		z /= wp;
+	}
+	void draw(){
+		if(!available)return;
+		if(!inview(x,y,r,r))return;
+		glm::mat4 MVP;
+		glm::mat4 VP = Matrices.projection * Matrices.view;
+		Matrices.model = translate;
 		MVP = VP*Matrices.model;
 		glUniformMatrix4fv(Matrices.MatrixID,1,GL_FALSE,&MVP[0][0]);
 		draw3DObject(circle);	
@@ -692,52 +1960,141 @@ typedef struct power{       //singleton,only one instance needed
 		}
 	}
 }power;
-bool checkCollisionCircle(ball b,obstacle o){
+bool checkCollisionCircle(ball &b,obstacle &o){
 	float d = sqrt((b.x-o.x)*(b.x-o.x) + (b.y-o.y)*(b.y-o.y));
 	return d<=b.r+o.r;
 }
-bool checkCollisionRect(ball b,obstacle o){
-	if(b.x>=o.x-o.w/2.0-b.r&&b.x<=o.x+o.w/2+b.r&&b.y>=o.y-o.h/2.0-b.r&&b.y<=o.y+o.h/2.0+b.r)
+bool checkCollisionRect(ball &b,obstacle &o){
+	float hw,hh;
+	o.extent(hw,hh);
+	if(b.x>=o.x-hw-b.r&&b.x<=o.x+hw+b.r&&b.y>=o.y-hh-b.r&&b.y<=o.y+hh+b.r)
 		return true;
 	return false;
 }
 void handleCollisionCircle(ball &b,obstacle &o){
 //	if(b.collision_obj)return;
-	float phi,theta,alpha;  //phi = angle with x-axis line joining both centres and theta = angle of velocity vector of ball
-	float vn,vt,a = 1.0;
-	theta = b.vely/b.velx;
-	phi = (o.y-b.y)/(o.x-b.x);
-	alpha = theta - phi;
-	vn = b.vel*cos(alpha),vt=b.vel*sin(alpha);
-	float beta = (vt*cos(phi)-a*vn*sin(phi))/(vt*sin(phi)+a*vn*cos(phi));
-	beta = atan(beta);
-	b.vel = sqrt(vt*vt + a*a*vn*vn);
+	float dx=b.x-o.x,dy=b.y-o.y,d=sqrt(dx*dx+dy*dy);    //normal along the line joining both centres
+	float vx=b.velx,vy=b.vely;
 	b.collision_obj = true;
-	b.sx=b.x-b.stx,b.sy=b.y-b.sty;
-	b.shoot(M_PI-beta);
+	if(d>0&&impulse(vx,vy,dx/d,dy/d,BLOCKBOUNCE,BLOCKFRICTION))b.relaunch(vx,vy);
 }
 void handleCollisionRect(ball &b,obstacle &o){
-	float ang,alpha=1;
-	if(b.x<=o.x-o.w/2-b.r){
-		ang = M_PI/2.0 + atan(alpha*b.velx/b.vely);
-		b.vel = sqrt(sq(b.vely)+sq(alpha*b.velx));
+	float nx,ny,vx=b.velx,vy=b.vely;
+	boxNormal(b.x,b.y,o.x,o.y,o.w/2,o.h/2,nx,ny);
+	b.collision_obj=true;
+	if(impulse(vx,vy,nx,ny,BLOCKBOUNCE,BLOCKFRICTION))b.relaunch(vx,vy);
+}
+ball my;
+
+/* Split fragments (power 3) come from a fixed pool of balls. Free slots form a
+   list threaded through nextfree and live ones are packed in live, so spawning
+   and releasing are O(1) and nothing is allocated during play. A handle holds
+   the slot in its low 16 bits and the slot's generation above them; releasing
+   bumps the generation, so a handle kept after its fragment is gone (even if
+   the slot holds a new one) resolves to NULL. All fragments share one mesh and
+   are drawn with a single instanced call, their offsets written to vertexstream */
+const int MAXFRAGMENTS=512;
+const float FRAGMENTR=15;
+typedef unsigned int fraghandle;     //0 is no fragment
+void clearcollisions(ball &b);
+typedef struct fragmentpool{
+	ball balls[MAXFRAGMENTS];
+	unsigned short generation[MAXFRAGMENTS];
+	int nextfree[MAXFRAGMENTS],freehead;
+	int live[MAXFRAGMENTS],where[MAXFRAGMENTS],count;    //where: index in live
+	vaohandle mesh;
+	fragmentpool(){
+		for(int i=0;i<MAXFRAGMENTS;++i)generation[i]=1,nextfree[i]=i+1;
+		nextfree[MAXFRAGMENTS-1]=-1;
+		freehead=count=0;
 	}
-	else if(b.y>=o.y+o.h/2+b.r){
-		//top
+	fraghandle spawn(){                //0 when the pool is full
+		if(freehead<0)return 0;
+		int i=freehead;
+		freehead=nextfree[i];
+		where[i]=count,live[count++]=i;
+		balls[i].reset();
+		balls[i].r=FRAGMENTR;
+		return i|generation[i]<<16;
 	}
-	else if(b.x>=o.x+o.w/2+b.r){
-		//right side
+	ball* get(fraghandle h){
+		int i=h&0xffff;
+		return h&&i<MAXFRAGMENTS&&generation[i]==h>>16?&balls[i]:NULL;
 	}
-	else if(b.y<=o.y-o.h/2-o.r){
-		ang = -1.0*atan(alpha*b.vely/b.velx);
-		b.vel = sqrt(sq(alpha*b.vely)+sq(b.velx));
+	fraghandle handle(int k){          //of the k-th live fragment
+		return live[k]|generation[live[k]]<<16;
+	}
+	void release(fraghandle h){        //stale handles are ignored
+		if(!get(h))return;
+		int i=h&0xffff,k=where[i];
+		if(++generation[i]==0)generation[i]=1;
+		live[k]=live[--count],where[live[k]]=k;
+		nextfree[i]=freehead,freehead=i;
+	}
+	void clear(){
+		while(count>0)release(handle(count-1));
+	}
+	/* The shared mesh. Made once: its VAO has attribute 2 per instance,so it
+	   must not go back to gpumem for other objects */
+	void create(color c){
+		if(mesh)return;
+		mesh=createCircle(FRAGMENTR,c);
+		if(HEADLESS)return;
+		glBindVertexArray(mesh->VertexArrayID);
+		glVertexAttribDivisor(2,1);
+	}
+	/* Flies,slides or leaves the window (then goes back to the pool) */
+	void step(float s){
+		for(int k=count-1;k>=0;--k){   //release moves the last one here,already done
+			ball &b=balls[live[k]];
+			if(b.outside())release(handle(k));
+			else if(b.active())b.fire(s),clearcollisions(b);
+		}
+	}
+	void draw(){
+		if(!count||!mesh)return;
+		GLintptr offset;
+		GLfloat *xy=(GLfloat*)vertexstream.alloc(2*count*sizeof(GLfloat),offset);
+		if(!xy)return;
+		int n=0;
+		for(int k=0;k<count;++k){
+			ball &b=balls[live[k]];
+			if(!b.placed)continue;         //as ball::draw
+			b.placed=b.asleep;
+			if(!inview(b.x,b.y,b.r,b.r))continue;
+			xy[2*n]=b.x,xy[2*n+1]=b.y,++n;
+		}
+		vertexstream.commit();
+		if(!n)return;
+		glBindVertexArray(mesh->VertexArrayID);
+		glBindBuffer(GL_ARRAY_BUFFER,vertexstream.buffer);
+		glVertexAttribPointer(2,2,GL_FLOAT,GL_FALSE,0,(void*)offset);
+		glm::mat4 MVP = Matrices.projection * Matrices.view;
+		glUniformMatrix4fv(Matrices.MatrixID,1,GL_FALSE,&MVP[0][0]);
+		draw3DObjectInstanced(mesh,n);
+	}
+}fragmentpool;
+fragmentpool fragments;
+int SPLIT=2;                         //--split <n>,fragments per split
+fraghandle SPLITFRAGMENTS[MAXFRAGMENTS];
+int NSPLIT=0;
+/* Burst b into SPLIT fragments fanned out between its direction and that
+   mirrored about the horizontal. They replace what is left of the last split */
+void splitBall(ball &b){
+	for(int k=0;k<NSPLIT;++k)fragments.release(SPLITFRAGMENTS[k]);
+	NSPLIT=0;
+	float a=atan(b.vely/b.velx);
+	for(int i=0;i<SPLIT;++i){
+		fraghandle h=fragments.spawn();
+		ball *f=fragments.get(h);
+		if(!f)break;
+		f->sx=b.x-STX,f->sy=b.y-STY;
+		f->stx=STX,f->sty=STY;
+		f->vel=300;
+		f->shoot(SPLIT>1?a-2*a*i/(SPLIT-1):a);
+		SPLITFRAGMENTS[NSPLIT++]=h;
 	}
-	b.collision_obj=true;
-	b.sx=b.x-b.stx,b.sy=b.y-b.sty;
-	b.shoot(ang);
 }
-ball my;
-ball powerball[3];
 ground gameground;
 sky gamesky;
 obstacle test,test2;
@@ -745,7 +2102,150 @@ power testpow;
 float ang,ZOOM=1.0;
 float add = 0;
 int OBSTACLES=0;
-VAO* life[10];
+/* Everything that stays put until something knocks it, ground, sky and the
+   sleeping blocks and floors, transformed once into one mesh and drawn with a
+   single call. Built when a level is loaded. A body that wakes is cut out (its
+   triangles collapsed in place) and drawn on its own from then on; moving walls
+   and targets always are */
+typedef struct staticbatch{
+	vaohandle mesh;
+	vector<int> first;              //per obstacle,its first vertex in mesh or -1
+	vector<GLfloat> vbd,cbd;
+	int cut=0;                      //bodies cut out since the last build
+	int version=0;                  //bumped by every build and cut,for copies of the mesh
+	void append(const GLfloat *v,const GLfloat *c,int n){
+		vbd.insert(vbd.end(),v,v+3*n);
+		cbd.insert(cbd.end(),c,c+3*n);
+	}
+	void build(){
+		if(HEADLESS)return;
+		vertexstream.reserve(streamring::BASE+OBSTACLES*(2*18+4)*sizeof(GLfloat));  //room to draw every obstacle knocked loose,or as a target
+		vbd.clear(),cbd.clear();
+		append(gameground.vbd,gameground.cbd,6);
+		append(gamesky.vbd,gamesky.cbd,6);
+		first.assign(OBSTACLES,-1);
+		for(int i=0;i<OBSTACLES;++i){
+			obstacle &o=allobstacles[i];
+			if(!o.dynamic||o.awake)continue;
+			int at=vbd.size();
+			first[i]=at/3;
+			vbd.resize(at+18),cbd.resize(at+18);
+			o.corners(&vbd[at],&cbd[at]);
+		}
+		mesh=create3DObject(GL_TRIANGLES,vbd.size()/3,&vbd[0],&cbd[0],GL_FILL);
+		cut=0,version++;
+	}
+	bool batched(int i){
+		return i<(int)first.size()&&first[i]>=0;
+	}
+	/* Cut out the bodies knocked awake since the last frame */
+	void update(){
+		if(!mesh)return;
+		static const GLfloat collapsed[18]={};
+		for(int i=0;i<(int)first.size();++i){
+			if(first[i]<0||!allobstacles[i].awake)continue;
+			glBindBuffer(GL_ARRAY_BUFFER,mesh->VertexBuffer);
+			glBufferSubData(GL_ARRAY_BUFFER,first[i]*3*sizeof(GLfloat),sizeof(collapsed),collapsed);
+			first[i]=-1,cut++,version++;
+		}
+	}
+	void draw(const glm::mat4 &VP){
+		if(!mesh)return;
+		glUniformMatrix4fv(Matrices.MatrixID,1,GL_FALSE,&VP[0][0]);
+		draw3DObject(mesh);
+	}
+}staticbatch;
+staticbatch staticlayer;
+/* The obstacles left out of staticlayer, in two calls whatever their number.
+   Walls and knocked blocks are transformed here and written to vertexstream;
+   targets are one circle of radius 1 drawn instanced, each moved and scaled to
+   its own centre and radius */
+typedef struct movingbatch{
+	GLuint vao=0;                   //positions,then colours,from vertexstream
+	vaohandle circle;               //attribute 2 per instance,as fragmentpool::create
+	vector<int> blocks,targets;     //visible this frame
+	void draw(){
+		blocks.clear(),targets.clear();
+		for(int i=0;i<OBSTACLES;++i){
+			obstacle &o=allobstacles[i];
+			if(staticlayer.batched(i)||(o.target&&!o.available)||!o.visible())continue;
+			if(o.circle)targets.push_back(i);
+			else blocks.push_back(i);
+		}
+		drawBlocks();
+		drawTargets();
+	}
+	void drawTargets(){
+		int n=targets.size();
+		if(!n)return;
+		if(!circle){
+			circle=createCircle(1,TARGETCOLOR);
+			glBindVertexArray(circle->VertexArrayID);
+			glVertexAttribDivisor(2,1);
+		}
+		GLintptr offset;
+		GLfloat *xyzw=(GLfloat*)vertexstream.alloc(4*n*sizeof(GLfloat),offset);
+		if(!xyzw)return;
+		for(int k=0;k<n;++k){
+			obstacle &o=allobstacles[targets[k]];
+			GLfloat *p=xyzw+4*k;
+			p[0]=o.x,p[1]=o.y,p[2]=0,p[3]=o.r;
+		}
+		vertexstream.commit();
+		glBindVertexArray(circle->VertexArrayID);
+		glBindBuffer(GL_ARRAY_BUFFER,vertexstream.buffer);
+		glVertexAttribPointer(2,4,GL_FLOAT,GL_FALSE,0,(void*)offset);
+		glm::mat4 MVP = Matrices.projection * Matrices.view;
+		glUniformMatrix4fv(Matrices.MatrixID,1,GL_FALSE,&MVP[0][0]);
+		draw3DObjectInstanced(circle,n);
+	}
+	void drawBlocks(){
+		int n=6*blocks.size();
+		if(!n)return;
+		GLintptr offset;
+		GLfloat *vbd=(GLfloat*)vertexstream.alloc(2*3*n*sizeof(GLfloat),offset);
+		if(!vbd)return;
+		GLfloat *cbd=vbd+3*n;
+		for(int k=0;k<(int)blocks.size();++k)allobstacles[blocks[k]].corners(vbd+18*k,cbd+18*k);
+		vertexstream.commit();
+		if(!vao){
+			glGenVertexArrays(1,&vao);
+			glBindVertexArray(vao);
+			glEnableVertexAttribArray(0);
+			glEnableVertexAttribArray(1);
+		}
+		glBindVertexArray(vao);
+		glBindBuffer(GL_ARRAY_BUFFER,vertexstream.buffer);
+		glVertexAttribPointer(0,3,GL_FLOAT,GL_FALSE,0,(void*)offset);
+		glVertexAttribPointer(1,3,GL_FLOAT,GL_FALSE,0,(void*)(offset+3*n*sizeof(GLfloat)));
+		glm::mat4 MVP = Matrices.projection * Matrices.view;
+		glUniformMatrix4fv(Matrices.MatrixID,1,GL_FALSE,&MVP[0][0]);
+		DRAWCALLS++;
+		glPolygonMode(GL_FRONT_AND_BACK,GL_FILL);
+		glDrawArrays(GL_TRIANGLES,0,n);
+	}
+}movingbatch;
+movingbatch movingblocks;
+vaohandle lives;         //one circle per life left,drawn instanced
+/* The lives in the top left corner, their offsets written to vertexstream */
+void drawLives(){
+	if(!lives||LIFES<=0)return;
+	GLintptr offset;
+	GLfloat *xy=(GLfloat*)vertexstream.alloc(2*LIFES*sizeof(GLfloat),offset);
+	if(!xy)return;
+	int n=0;
+	for(int i=0;i<LIFES;++i){
+		if(inview(-620+35*i,480,15,15))xy[2*n]=-620+35*i,xy[2*n+1]=480,++n;
+	}
+	vertexstream.commit();
+	if(!n)return;
+	glBindVertexArray(lives->VertexArrayID);
+	glBindBuffer(GL_ARRAY_BUFFER,vertexstream.buffer);
+	glVertexAttribPointer(2,2,GL_FLOAT,GL_FALSE,0,(void*)offset);
+	glm::mat4 MVP = Matrices.projection * Matrices.view;
+	glUniformMatrix4fv(Matrices.MatrixID,1,GL_FALSE,&MVP[0][0]);
+	draw3DObjectInstanced(lives,n);
+}
 /* Executed when a regular key is pressed/released/held-down */
 /* Prefered for Keyboard events */
 void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
@@ -777,7 +2277,7 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
 					my.power=true;
 					testpow.inx = my.x;
 					testpow.iny = my.y;
-					testpow.inti=glfwGetTime();
+					testpow.inti=gametime();
 					my.shootpower=false;
 				}
 				break;
@@ -789,18 +2289,7 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
 				}
 				break;
 			case GLFW_KEY_3:
-				if(my.isshoot&&my.shootpower){
-					for(int i=0;i<2;++i){
-						powerball[i].sx=my.x-STX;
-						powerball[i].sy=my.y-STY;
-						powerball[i].stx=STX;
-						powerball[i].sty=STY;
-						powerball[i].vel=300;
-						if(i==0)powerball[i].shoot(atan(my.vely/my.velx));
-						else powerball[i].shoot(-1*atan(my.vely/my.velx));
-					}
-					
-				}
+				if(my.isshoot&&my.shootpower)splitBall(my);
 				my.shootpower=false;
 				break;
 			default:
@@ -825,6 +2314,7 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
 	
 }
 
+void restartLevel();
 /* Executed for character input (like in text boxes) */
 void keyboardChar (GLFWwindow* window, unsigned int key)
 {
@@ -833,6 +2323,24 @@ void keyboardChar (GLFWwindow* window, unsigned int key)
 		case 'q':
 			quit(window);
 			break;
+		case 'R':
+		case 'r':
+			restartLevel();
+			break;
+		case 'G':
+		case 'g':
+			gpumem.print();
+			break;
+		case 'T':
+		case 't':
+			if(TRACING)trace.write(TRACEFILE);
+			else printf("Tracing is off, start with --trace <file>\n");
+			break;
+		case 'P':
+		case 'p':
+			PROFILING=!PROFILING;
+			prof.started=false;
+			break;
 		default:
 			break;
 	}
@@ -855,12 +2363,90 @@ void mouseButton (GLFWwindow* window, int button, int action, int mods)
 	}
 }
 //mouse cursorPosition callback
-void poscallback(GLFWwindow* window,double xp,double yp){
+void aimAt(double xp,double yp){        //point the cannon at a cursor position
 	double lx,ly;
 	ly=1000.0/2.0 + 3.5*115-yp;
 	lx=xp-1300.0/2.0+3.5*115;
 	pipe_rot=-1.0*atan(lx/ly)*180.0f/M_PI;
 }
+void poscallback(GLFWwindow* window,double xp,double yp){
+	aimAt(xp,yp);
+}
+
+/* Input to present latency, and late cursor sampling for --lowlatency.
+   Normally the aim comes from poscallback when events are polled after the
+   previous swap. In low latency mode the loop waits for each swap to finish,
+   sleeps until just enough time is left to render the next frame, then reads
+   the cursor right before step(); --predict extrapolates the cursor to the
+   expected present time. Latency runs from that input sample until the fence
+   placed after the frame's swap signals */
+bool LOWLATENCY=false,PREDICT=false;
+typedef struct inputsampler{
+	enum { SLOTS = 4 };
+	GLsync fences[SLOTS];
+	double sampled[SLOTS];
+	int head = 0, pending = 0;
+	double inputtime = 0;          //when the input for this frame was read
+	double presented = 0;          //when the last swap finished
+	double worktime = 0.004;       //sample until rendering is done, decaying max
+	double latency = 0.016;        //smoothed,for prediction
+	double lastx = 0, lasty = 0, lastt = 0;
+	void polled(){                 //events were just read
+		inputtime = glfwGetTime();
+	}
+	void late(GLFWwindow* window,double period){
+		const double MARGIN = 0.0015;
+		if(presented > 0 && period > 0){
+			double start = presented + period - worktime - MARGIN, now = glfwGetTime();
+			if(start > now)std::this_thread::sleep_for(std::chrono::duration<double>(start - now));
+		}
+		glfwPollEvents();
+		double xp, yp, t = glfwGetTime();
+		glfwGetCursorPos(window, &xp, &yp);
+		double px = xp, py = yp;
+		if(PREDICT && lastt > 0 && t > lastt){
+			double ahead = min(latency, 0.05);
+			px += (xp - lastx) / (t - lastt) * ahead;
+			py += (yp - lasty) / (t - lastt) * ahead;
+		}
+		lastx = xp, lasty = yp, lastt = t;
+		aimAt(px, py);
+		inputtime = t;
+	}
+	/* Right after draw(), before pacing sleeps: how long the input sample,
+	   step() and rendering took, so late() leaves that much before the deadline */
+	void rendered(){
+		if(!LOWLATENCY)return;
+		GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+		glDeleteSync(fence);
+		worktime = max(glfwGetTime() - inputtime, worktime * 0.98);
+	}
+	void afterswap(){
+		if(pending == SLOTS){          //never signalled, drop the oldest
+			glDeleteSync(fences[head]);
+			head = (head + 1) % SLOTS, pending--;
+		}
+		int slot = (head + pending) % SLOTS;
+		fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		sampled[slot] = inputtime;
+		pending++;
+		collect(LOWLATENCY);
+	}
+	void collect(bool wait){       //record latency of every finished swap
+		while(pending){
+			GLenum r = glClientWaitSync(fences[head], GL_SYNC_FLUSH_COMMANDS_BIT, wait ? GL_TIMEOUT_IGNORED : 0);
+			if(r == GL_TIMEOUT_EXPIRED)return;
+			presented = glfwGetTime();
+			double l = presented - sampled[head];
+			latency += (l - latency) * 0.1;
+			if(PROFILING)prof.peak(profiler::LATENCYROW, l * 1000);
+			glDeleteSync(fences[head]);
+			head = (head + 1) % SLOTS, pending--;
+		}
+	}
+}inputsampler;
+inputsampler input;
 //mouse scroll-bar callback
 double currentYoffset=0;
 void scrollcallback(GLFWwindow* window,double xoffset,double yoffset){
@@ -871,35 +2457,157 @@ void scrollcallback(GLFWwindow* window,double xoffset,double yoffset){
 	else ZOOM = ZOOM = ZOOM*2*abs(currentYoffset);
 	//ZOOM/=yoffset;
 }
+typedef struct camera{         //owns viewport,projection and view; rebuilt only when they change
+	float zoom,panx;           //values the current matrices were built with
+	int fbwidth,fbheight;
+	bool dirty;
+	void init(GLFWwindow* window,int width,int height){
+		fbwidth=width,fbheight=height;
+		if(window)glfwGetFramebufferSize(window,&fbwidth,&fbheight);    //NULL when offscreen
+		zoom=ZOOM;
+		panx=PANX;
+		dirty=true;
+		apply();
+		view();
+	}
+	void resize(int w,int h){
+		fbwidth=w,fbheight=h;
+		dirty=true;
+	}
+	void update(float dt){
+		TRACE("camera");
+		float rate=12.0;        //zoom animation speed,larger is snappier
+		if(zoom!=ZOOM){         //ZOOM is the requested zoom,ease towards it
+			zoom+=(ZOOM-zoom)*(1-exp(-rate*dt));
+			if(abs(zoom-ZOOM)<=0.001*ZOOM)zoom=ZOOM;
+			dirty=true;
+		}
+		if(dirty)apply();
+		if(panx!=PANX)view();
+	}
+	void apply(){
+		// sets the viewport of openGL renderer
+		glViewport (0, 0, (GLsizei) fbwidth+add, (GLsizei) fbheight);
+
+		// Ortho projection for 2D views
+		VIEWW = 650.0f*zoom,VIEWH = 500.0f*zoom;     //used for culling
+		Matrices.projection = glm::ortho(-VIEWW, VIEWW, -VIEWH, VIEWH, 0.1f, 500.0f);
+		dirty=false;
+	}
+	void view(){
+		panx=PANX;
+		Matrices.view = glm::lookAt(glm::vec3(0+PANX,0,3), glm::vec3(0+PANX,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
+	}
+}camera;
+camera gamecamera;
+/* staticlayer drawn once into a texture that reaches half a view past the
+   screen on each side, then put on screen with one quad; panning only moves
+   the texture coordinates. Drawn again when the level, the zoom or the window
+   size change, when bodies cut out of staticlayer stop coming loose, or when
+   the view pans past the margin. While a zoom animates or a shot is still
+   knocking blocks loose, staticlayer is drawn directly. So it is when it is
+   small: under llvmpipe sampling a screen of texture costs more than filling
+   a few flat quads, the texture only pays off for large levels */
+typedef struct backgroundcache{
+	GLuint fbo=0,texture=0,vao=0,quad=0,program=0;
+	GLint OffsetID=-1,ScaleID=-1;
+	static const int MINVERTICES=4096;     //smaller staticlayers are drawn directly
+	GLint maxsize=0;                //GL_MAX_TEXTURE_SIZE,wider views draw staticlayer directly
+	int width=0,height=0,margin=0;  //texture size and pixels on each side beyond the view
+	float vieww=0,centre=0;         //view the texture was drawn for
+	int version=-1;                 //staticlayer.version it holds
+	bool dirty=true;                //shaders reloaded
+	static const int SETTLE=10;     //frames without a cut before the texture is drawn again
+	int lastcut=0,steady=0;         //staticlayer.cut last frame,frames since it grew
+	int renders=0;                  //times staticlayer was drawn into it
+	void create(){
+		if(vao||HEADLESS)return;
+		static const GLfloat corners[]={-1,-1, 1,-1, -1,1, 1,1};     //the whole screen in clip space
+		glGenVertexArrays(1,&vao);
+		glBindVertexArray(vao);
+		glGenBuffers(1,&quad);
+		glBindBuffer(GL_ARRAY_BUFFER,quad);
+		glBufferData(GL_ARRAY_BUFFER,sizeof(corners),corners,GL_STATIC_DRAW);
+		glVertexAttribPointer(0,2,GL_FLOAT,GL_FALSE,0,(void*)0);
+		glEnableVertexAttribArray(0);
+		glGenTextures(1,&texture);
+		glGenFramebuffers(1,&fbo);
+		glGetIntegerv(GL_MAX_TEXTURE_SIZE,&maxsize);
+	}
+	/* Draw staticlayer into the texture for a w x h view centred on the camera,
+	   with the same pixels per unit as the screen so texels land on pixels */
+	void render(int w,int h){
+		TRACE("background render");
+		int m=w/2;
+		if(width!=w+2*m||height!=h){
+			width=w+2*m,height=h;
+			glBindTexture(GL_TEXTURE_2D,texture);
+			glTexImage2D(GL_TEXTURE_2D,0,GL_RGB8,width,height,0,GL_RGB,GL_UNSIGNED_BYTE,NULL);
+			glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_S,GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_T,GL_CLAMP_TO_EDGE);
+		}
+		GLint screen;            //the window,or initEGL's framebuffer
+		glGetIntegerv(GL_FRAMEBUFFER_BINDING,&screen);
+		glBindFramebuffer(GL_FRAMEBUFFER,fbo);
+		glFramebufferTexture2D(GL_FRAMEBUFFER,GL_COLOR_ATTACHMENT0,GL_TEXTURE_2D,texture,0);
+		glViewport(0,0,width,height);
+		glClear(GL_COLOR_BUFFER_BIT);
+		float half=VIEWW*width/w;
+		glm::mat4 VP=glm::ortho(-half,half,-VIEWH,VIEWH,0.1f,500.0f)*Matrices.view;
+		staticlayer.draw(VP);
+		glBindFramebuffer(GL_FRAMEBUFFER,screen);
+		glViewport(0,0,w,h);
+		margin=m,vieww=VIEWW,centre=gamecamera.panx,version=staticlayer.version,dirty=false;
+		renders++;
+	}
+	void draw(){
+		if(!staticlayer.mesh)return;
+		int w=gamecamera.fbwidth+add,h=gamecamera.fbheight;
+		if(staticlayer.cut>lastcut)steady=0;
+		else if(steady<SETTLE)steady++;
+		lastcut=staticlayer.cut;                  //a new level starts again from 0
+		bool cutting=steady<SETTLE&&version!=staticlayer.version;    //texture out of date,more cuts likely
+		if(!program||staticlayer.vbd.size()<3*MINVERTICES||w+2*(w/2)>maxsize||gamecamera.zoom!=ZOOM||cutting){    //zoom still easing towards ZOOM
+			staticlayer.draw(Matrices.projection*Matrices.view);
+			return;
+		}
+		float ppu=w/(2*VIEWW);                    //screen pixels per unit
+		float shift=floor((gamecamera.panx-centre)*ppu+0.5);  //whole pixels panned since the texture was drawn
+		if(dirty||version!=staticlayer.version||vieww!=VIEWW||width!=w+2*(w/2)||height!=h||fabs(shift)>margin){
+			render(w,h);
+			shift=0;
+		}
+		// Nothing is drawn behind the background,so it leaves the depth buffer cleared
+		glUseProgram(program);
+		glUniform1f(OffsetID,(margin+shift)/width);
+		glUniform1f(ScaleID,(float)w/width);
+		glBindTexture(GL_TEXTURE_2D,texture);
+		glBindVertexArray(vao);
+		glDepthMask(GL_FALSE);
+		glDisable(GL_DEPTH_TEST);
+		glDrawArrays(GL_TRIANGLE_STRIP,0,4);
+		DRAWCALLS++;
+		glEnable(GL_DEPTH_TEST);
+		glDepthMask(GL_TRUE);
+		glUseProgram(programID);
+	}
+}backgroundcache;
+backgroundcache background;
 /* Executed when window is resized to 'width' and 'height' */
-/* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
+/* Projection is rebuilt by gamecamera on the next frame */
 void reshapeWindow (GLFWwindow* window, int width, int height)
 {
 	int fbwidth=width, fbheight=height;
 	/* With Retina display on Mac OS X, GLFW's FramebufferSize
 	   is different from WindowSize */
 	glfwGetFramebufferSize(window, &fbwidth, &fbheight);
-
-	GLfloat fov = 90.0f;
-
-	// sets the viewport of openGL renderer
-	glViewport (0, 0, (GLsizei) fbwidth+add, (GLsizei) fbheight);
-
-	// set the projection matrix as perspective
-	/* glMatrixMode (GL_PROJECTION);
-	   glLoadIdentity ();
-	   gluPerspective (fov, (GLfloat) fbwidth / (GLfloat) fbheight, 0.1, 500.0); */
-	// Store the projection matrix in a variable for future use
-	// Perspective projection for 3D views
-	// Matrices.projection = glm::perspective (fov, (GLfloat) fbwidth / (GLfloat) fbheight, 0.1f, 500.0f);
-
-	// Ortho projection for 2D views
-	//Matrices.projection = glm::ortho(-4.0f, 4.0f, -4.0f, 4.0f, 0.1f, 500.0f);
-	Matrices.projection = glm::ortho(-650.0f*ZOOM, 650.0f*ZOOM, -500.0f*ZOOM, 500.0f*ZOOM, 0.1f, 500.0f);
+	gamecamera.resize(fbwidth,fbheight);
 }
 
-VAO *triangle, *rectangle,*shape;
-VAO *box,*circle,*pipe,*spring;
+vaohandle triangle,rectangle,shape;
+vaohandle box,circle,barrel,spring;
 
 // Creates the triangle object used in this sample code
 void createTriangle ()
@@ -965,7 +2673,7 @@ static const GLfloat vertex_buffer_data [] ={
 		0,0,0, // color 4
 		0,0,0  // color 1
 	};
-	pipe = create3DObject(GL_TRIANGLES,6,vertex_buffer_data,color_buffer_data,GL_FILL);	
+	barrel = create3DObject(GL_TRIANGLES,6,vertex_buffer_data,color_buffer_data,GL_FILL);	
 }
 void createSpring(){
 static const GLfloat vertex_buffer_data [] ={
@@ -1022,45 +2730,668 @@ void createShape(){
 		}
 	shape = create3DObject(GL_POINTS,2*v,vbd,cbd,GL_FILL);
 }
-void clearcollisions(ball b){    //while colliding with an object clear collisions
+void clearcollisions(ball &b){    //the ball left the obstacle it last hit,it can be hit again
 	float delta = 10.0;
-	for (int i = 0; i < OBSTACLES; ++i)
-	{	float x=allobstacles[i].x;
-		float y=allobstacles[i].y;
-		float w=allobstacles[i].w;
-		float h=allobstacles[i].h;
-		// if(b.x>=x-w/2.0-b.r&&b.x<=x+w/2.0+b.r&&b.y>=y-h/2.0-b.r&&b.y<=y+h/2.0+b.r==0)
-		// 	allobstacles[i].collision=false;
-		if(b.x<=x-w/2.0-b.r-delta||b.x>=x+w/2.0+b.r+delta||b.y<=y-h/2.0-b.r-delta||b.y>=y+h/2.0+b.r+delta)
-			if(allobstacles[i].collision)allobstacles[i].collision=false;
+	if(b.touching<0)return;
+	obstacle &o=allobstacles[b.touching];
+	float lx,ly;
+	o.local(b.x,b.y,lx,ly);
+	if(fabs(lx)>=o.w/2.0+b.r+delta||fabs(ly)>=o.h/2.0+b.r+delta)
+		b.touching=-1;
+}
+/* Rigid bodies. Blocks and floors are boxes that slide, rotate and topple.
+   Each step applies gravity, finds contacts (sort and sweep on x, then box
+   clipping as in box2d-lite) and solves them with sequential impulses, warm
+   started with what the same contact points needed the step before. Bodies
+   that touch form an island; an island whose bodies all stay slower than
+   SLEEPLINEAR/SLEEPANGULAR for BODYSLEEPTIME goes to sleep and is skipped
+   until something hits it. Levels start asleep, so a floor with nothing under
+   it stays up until it is knocked. Moving walls and targets are not bodies */
+const float BODYGROUND=-325;       //obstacles stand on this
+const float BODYDT=1.0/60;
+const int BODYITERATIONS=20;
+const float BODYSLOP=0.5,BODYBIAS=0.2,MAXPUSH=2;    //overlap left alone (px),fraction removed per step,most overlap removed per step
+const float BODYMARGIN=1;          //points this far apart are already contacts,so a tilt of a few hundredths does not drop one
+const float BODYFRICTION=0.5,BODYSLEEPTIME=0.5;
+const float WAKESPEED=20;          //px/s,a knock smaller than this leaves a sleeping body asleep
+
+typedef struct contact{
+	glm::vec2 p,n;                 //position,normal from body a to body b
+	float sep;                     //separation,negative when overlapping
+	float gap;                     //closing speed that just touches this step,sep>0 only
+	float pn,pt;                   //accumulated impulses,carried to the next step
+	float pp;                      //accumulated push out of overlap,this step only
+	float massn,masst,bias;
+	int feature;                   //edges (or corner) that made it,to match it next step
+}contact;
+typedef struct arbiter{
+	int a,b;                       //a<b,a=-1 is the ground
+	int n;
+	contact c[2];
+	float ma,ia,mb,ib;             //inverse masses this step,0 for the ground and sleeping bodies
+	float k11,k12,k22;             //both normal impulses solved together (n==2)
+	bool block;
+}arbiter;
+long long arbiterkey(const arbiter &ar){
+	return ((long long)(ar.a+1)<<32)|ar.b;
+}
+bool arbiterless(const arbiter &l,const arbiter &r){
+	return arbiterkey(l)<arbiterkey(r);
+}
+vector<arbiter> ARBITERS;          //touching an awake body,solved this step,sorted by arbiterkey
+unordered_map<long long,arbiter> RESTING;    //between sleeping bodies,kept as they were
+vector<long long> PASSTHROUGH;     //sorted keys of pairs placed overlapping,they never collide
+obstacle GROUNDBODY;               //never moves,zero inverse mass
+double BODYTIME=-1;                //game time the bodies have been stepped to
+obstacle &bodyat(int i){
+	return i<0?GROUNDBODY:allobstacles[i];
+}
+glm::mat2 rotation(float a){
+	float c=cos(a),s=sin(a);
+	return glm::mat2(c,s,-s,c);
+}
+float cross(glm::vec2 a,glm::vec2 b){
+	return a.x*b.y-a.y*b.x;
+}
+
+/* Box clipping. Edges of a box in its own frame:
+            e1
+       v2 ------ v1
+    e2 |        | e4
+       v3 ------ v4
+            e3                                          */
+enum { NOEDGE, EDGE1, EDGE2, EDGE3, EDGE4 };
+typedef struct clipvertex{
+	glm::vec2 v;
+	unsigned char in1,out1,in2,out2;
+}clipvertex;
+int clipSegment(clipvertex out[2],clipvertex in[2],glm::vec2 n,float offset,unsigned char edge){
+	int k=0;
+	float d0=glm::dot(n,in[0].v)-offset,d1=glm::dot(n,in[1].v)-offset;
+	if(d0<=0)out[k++]=in[0];
+	if(d1<=0)out[k++]=in[1];
+	if(d0*d1<0){
+		clipvertex c=d0>0?in[0]:in[1];
+		if(d0>0)c.in1=edge,c.in2=NOEDGE;
+		else c.out1=edge,c.out2=NOEDGE;
+		c.v=in[0].v+d0/(d0-d1)*(in[1].v-in[0].v);
+		out[k++]=c;
+	}
+	return k;
+}
+/* The edge of box (half sizes h,at pos,rotated R) most anti-parallel to normal */
+void incidentEdge(clipvertex c[2],glm::vec2 h,glm::vec2 pos,glm::mat2 R,glm::vec2 normal){
+	glm::vec2 n=-(glm::transpose(R)*normal);
+	c[0]=c[1]=clipvertex();
+	if(fabs(n.x)>fabs(n.y)){
+		if(n.x>=0){
+			c[0].v=glm::vec2(h.x,-h.y),c[0].in2=EDGE3,c[0].out2=EDGE4;
+			c[1].v=glm::vec2(h.x,h.y),c[1].in2=EDGE4,c[1].out2=EDGE1;
+		}
+		else{
+			c[0].v=glm::vec2(-h.x,h.y),c[0].in2=EDGE1,c[0].out2=EDGE2;
+			c[1].v=glm::vec2(-h.x,-h.y),c[1].in2=EDGE2,c[1].out2=EDGE3;
+		}
 	}
+	else{
+		if(n.y>=0){
+			c[0].v=glm::vec2(h.x,h.y),c[0].in2=EDGE4,c[0].out2=EDGE1;
+			c[1].v=glm::vec2(-h.x,h.y),c[1].in2=EDGE1,c[1].out2=EDGE2;
+		}
+		else{
+			c[0].v=glm::vec2(-h.x,-h.y),c[0].in2=EDGE2,c[0].out2=EDGE3;
+			c[1].v=glm::vec2(h.x,-h.y),c[1].in2=EDGE3,c[1].out2=EDGE4;
+		}
+	}
+	c[0].v=pos+R*c[0].v,c[1].v=pos+R*c[1].v;
+}
+/* Contact points between two boxes,normal from A to B. Separating axis test on
+   the four face normals,then the incident edge is clipped to the reference face */
+int collideBoxes(obstacle &A,obstacle &B,contact *c){
+	glm::vec2 hA(A.w/2.0,A.h/2.0),hB(B.w/2.0,B.h/2.0),pA(A.x,A.y),pB(B.x,B.y);
+	glm::mat2 RA=rotation(A.angle),RB=rotation(B.angle),RAT=glm::transpose(RA),RBT=glm::transpose(RB);
+	glm::vec2 dp=pB-pA,dA=RAT*dp,dB=RBT*dp;
+	glm::mat2 C=RAT*RB;
+	glm::mat2 absC(fabs(C[0][0]),fabs(C[0][1]),fabs(C[1][0]),fabs(C[1][1])),absCT=glm::transpose(absC);
+	glm::vec2 faceA=glm::abs(dA)-hA-absC*hB;
+	if(faceA.x>BODYMARGIN||faceA.y>BODYMARGIN)return 0;
+	glm::vec2 faceB=glm::abs(dB)-absCT*hA-hB;
+	if(faceB.x>BODYMARGIN||faceB.y>BODYMARGIN)return 0;
+
+	const float RELTOL=0.95,ABSTOL=0.01;         //prefer A's faces,keeps the axis from flickering
+	int axis=0;
+	float sep=faceA.x;
+	glm::vec2 n=dA.x>0?RA[0]:-RA[0];
+	if(faceA.y>RELTOL*sep+ABSTOL*hA.y)axis=1,sep=faceA.y,n=dA.y>0?RA[1]:-RA[1];
+	if(faceB.x>RELTOL*sep+ABSTOL*hB.x)axis=2,sep=faceB.x,n=dB.x>0?RB[0]:-RB[0];
+	if(faceB.y>RELTOL*sep+ABSTOL*hB.y)axis=3,sep=faceB.y,n=dB.y>0?RB[1]:-RB[1];
+
+	glm::vec2 frontn,siden;
+	float front,side,negside,posside;
+	unsigned char negedge,posedge;
+	clipvertex inc[2];
+	if(axis<2){                      //reference face on A
+		frontn=n;
+		front=glm::dot(pA,frontn)+(axis==0?hA.x:hA.y);
+		siden=axis==0?RA[1]:RA[0];
+		side=glm::dot(pA,siden);
+		negside=-side+(axis==0?hA.y:hA.x),posside=side+(axis==0?hA.y:hA.x);
+		incidentEdge(inc,hB,pB,RB,frontn);
+	}
+	else{                            //reference face on B
+		frontn=-n;
+		front=glm::dot(pB,frontn)+(axis==2?hB.x:hB.y);
+		siden=axis==2?RB[1]:RB[0];
+		side=glm::dot(pB,siden);
+		negside=-side+(axis==2?hB.y:hB.x),posside=side+(axis==2?hB.y:hB.x);
+		incidentEdge(inc,hA,pA,RA,frontn);
+	}
+	negedge=axis%2==0?EDGE3:EDGE2,posedge=axis%2==0?EDGE1:EDGE4;
+	clipvertex c1[2],c2[2];
+	if(clipSegment(c1,inc,-siden,negside,negedge)<2)return 0;
+	if(clipSegment(c2,c1,siden,posside,posedge)<2)return 0;
+	int k=0;
+	for(int i=0;i<2;++i){
+		float s=glm::dot(frontn,c2[i].v)-front;
+		if(s>BODYMARGIN)continue;
+		clipvertex &v=c2[i];
+		if(axis>=2)swap(v.in1,v.in2),swap(v.out1,v.out2);
+		c[k].sep=s,c[k].n=n,c[k].p=v.v-s*frontn;
+		c[k].feature=v.in1|v.out1<<8|v.in2<<16|v.out2<<24;
+		c[k].pn=c[k].pt=0;
+		++k;
+	}
+	return k;
+}
+/* Corners of B below the ground,at most the two lowest */
+int collideGround(obstacle &B,contact *c){
+	glm::mat2 R=rotation(B.angle);
+	glm::vec2 corner[4];
+	float sx[4]={1,-1,-1,1},sy[4]={1,1,-1,-1};
+	int low[2]={-1,-1},k=0;
+	for(int i=0;i<4;++i){
+		corner[i]=glm::vec2(B.x,B.y)+R*glm::vec2(sx[i]*B.w/2.0,sy[i]*B.h/2.0);
+		if(low[0]<0||corner[i].y<corner[low[0]].y)low[1]=low[0],low[0]=i;
+		else if(low[1]<0||corner[i].y<corner[low[1]].y)low[1]=i;
+	}
+	for(int j=0;j<2;++j){
+		float s=corner[low[j]].y-BODYGROUND;
+		if(s>BODYMARGIN)continue;
+		c[k].sep=s,c[k].n=glm::vec2(0,1),c[k].p=corner[low[j]];
+		c[k].feature=low[j]+1;
+		c[k].pn=c[k].pt=0;
+		++k;
+	}
+	return k;
+}
+
+/* Fixed bodies (the ground,sleeping ones) are shared by islands solved at the
+   same time,so they are only read */
+void applyImpulse(arbiter &ar,obstacle &A,obstacle &B,glm::vec2 r1,glm::vec2 r2,glm::vec2 P){
+	if(ar.ma!=0)A.velx-=ar.ma*P.x,A.vely-=ar.ma*P.y,A.spin-=ar.ia*cross(r1,P);
+	if(ar.mb!=0)B.velx+=ar.mb*P.x,B.vely+=ar.mb*P.y,B.spin+=ar.ib*cross(r2,P);
+}
+void applyPush(arbiter &ar,obstacle &A,obstacle &B,glm::vec2 r1,glm::vec2 r2,glm::vec2 P){
+	if(ar.ma!=0)A.pushx-=ar.ma*P.x,A.pushy-=ar.ma*P.y,A.pushspin-=ar.ia*cross(r1,P);
+	if(ar.mb!=0)B.pushx+=ar.mb*P.x,B.pushy+=ar.mb*P.y,B.pushspin+=ar.ib*cross(r2,P);
+}
+glm::vec2 relativeVelocity(obstacle &A,obstacle &B,glm::vec2 r1,glm::vec2 r2){
+	return glm::vec2(B.velx-B.spin*r2.y,B.vely+B.spin*r2.x)-glm::vec2(A.velx-A.spin*r1.y,A.vely+A.spin*r1.x);
+}
+glm::vec2 relativePush(obstacle &A,obstacle &B,glm::vec2 r1,glm::vec2 r2){
+	return glm::vec2(B.pushx-B.pushspin*r2.y,B.pushy+B.pushspin*r2.x)-glm::vec2(A.pushx-A.pushspin*r1.y,A.pushy+A.pushspin*r1.x);
+}
+/* Effective masses and how fast to push out of overlap,then last step's impulses
+   again. A sleeping body counts as fixed,see stepBodies */
+void prestep(arbiter &ar,float invdt){
+	obstacle &A=bodyat(ar.a),&B=bodyat(ar.b);
+	ar.ma=A.awake?A.invmass:0,ar.ia=A.awake?A.invinertia:0;
+	ar.mb=B.awake?B.invmass:0,ar.ib=B.awake?B.invinertia:0;
+	for(int k=0;k<ar.n;++k){
+		contact &c=ar.c[k];
+		glm::vec2 r1=c.p-glm::vec2(A.x,A.y),r2=c.p-glm::vec2(B.x,B.y),t(c.n.y,-c.n.x);
+		float rn1=glm::dot(r1,c.n),rn2=glm::dot(r2,c.n),rt1=glm::dot(r1,t),rt2=glm::dot(r2,t);
+		float r11=glm::dot(r1,r1),r22=glm::dot(r2,r2);
+		c.massn=1/(ar.ma+ar.mb+ar.ia*(r11-rn1*rn1)+ar.ib*(r22-rn2*rn2));
+		c.masst=1/(ar.ma+ar.mb+ar.ia*(r11-rt1*rt1)+ar.ib*(r22-rt2*rt2));
+		c.bias=-BODYBIAS*invdt*max(min(0.0f,c.sep+BODYSLOP),-MAXPUSH);
+		c.gap=max(c.sep,0.0f)*invdt;
+		c.pp=0;
+		applyImpulse(ar,A,B,r1,r2,c.pn*c.n+c.pt*t);
+	}
+	ar.block=false;
+	if(ar.n<2)return;
+	glm::vec2 n=ar.c[0].n,pA(A.x,A.y),pB(B.x,B.y);
+	float a1=cross(ar.c[0].p-pA,n),b1=cross(ar.c[0].p-pB,n),a2=cross(ar.c[1].p-pA,n),b2=cross(ar.c[1].p-pB,n),m=ar.ma+ar.mb;
+	ar.k11=m+ar.ia*a1*a1+ar.ib*b1*b1;
+	ar.k22=m+ar.ia*a2*a2+ar.ib*b2*b2;
+	ar.k12=m+ar.ia*a1*a2+ar.ib*b1*b2;
+	ar.block=ar.k11*ar.k11<1000*(ar.k11*ar.k22-ar.k12*ar.k12);    //else the points are too close to tell apart
+}
+/* Overlap is removed with separate push velocities that only move the bodies
+   this step (split impulses),so resolving it never makes a stack bounce */
+void solvePush(arbiter &ar){
+	obstacle &A=bodyat(ar.a),&B=bodyat(ar.b);
+	for(int k=0;k<ar.n;++k){
+		contact &c=ar.c[k];
+		glm::vec2 r1=c.p-glm::vec2(A.x,A.y),r2=c.p-glm::vec2(B.x,B.y);
+		float vn=glm::dot(relativePush(A,B,r1,r2),c.n);
+		float pp=max(c.pp+c.massn*(-vn+c.bias),0.0f);
+		applyPush(ar,A,B,r1,r2,(pp-c.pp)*c.n);
+		c.pp=pp;
+	}
+}
+/* Friction first,then the normal impulses: one at a time,or for a resting
+   face both at once so neither corner ends up carrying more than its share
+   (solved as the 2x2 complementarity problem,trying each set of touching points) */
+void solveContacts(arbiter &ar){
+	obstacle &A=bodyat(ar.a),&B=bodyat(ar.b);
+	glm::vec2 r1[2],r2[2];
+	for(int k=0;k<ar.n;++k){
+		contact &c=ar.c[k];
+		r1[k]=c.p-glm::vec2(A.x,A.y),r2[k]=c.p-glm::vec2(B.x,B.y);
+		glm::vec2 t(c.n.y,-c.n.x);
+		float vt=glm::dot(relativeVelocity(A,B,r1[k],r2[k]),t),maxpt=BODYFRICTION*c.pn;
+		float pt=max(-maxpt,min(maxpt,c.pt-c.masst*vt));
+		applyImpulse(ar,A,B,r1[k],r2[k],(pt-c.pt)*t);
+		c.pt=pt;
+	}
+	if(!ar.block){
+		for(int k=0;k<ar.n;++k){
+			contact &c=ar.c[k];
+			float vn=glm::dot(relativeVelocity(A,B,r1[k],r2[k]),c.n);
+			float pn=max(c.pn-c.massn*(vn+c.gap),0.0f);    //accumulated impulse never pulls
+			applyImpulse(ar,A,B,r1[k],r2[k],(pn-c.pn)*c.n);
+			c.pn=pn;
+		}
+		return;
+	}
+	contact &c1=ar.c[0],&c2=ar.c[1];
+	glm::vec2 n=c1.n;
+	float a1=c1.pn,a2=c2.pn;
+	float b1=glm::dot(relativeVelocity(A,B,r1[0],r2[0]),n)+c1.gap-(ar.k11*a1+ar.k12*a2);
+	float b2=glm::dot(relativeVelocity(A,B,r1[1],r2[1]),n)+c2.gap-(ar.k12*a1+ar.k22*a2);
+	float det=ar.k11*ar.k22-ar.k12*ar.k12;
+	float x1=(ar.k12*b2-ar.k22*b1)/det,x2=(ar.k12*b1-ar.k11*b2)/det;     //both touching
+	if(x1<0||x2<0){
+		x1=-b1/ar.k11,x2=0;                                                 //first only
+		if(x1<0||ar.k12*x1+b2<0){
+			x1=0,x2=-b2/ar.k22;                                             //second only
+			if(x2<0||ar.k12*x2+b1<0){
+				x1=x2=0;                                                    //neither
+				if(b1<0||b2<0)return;                                       //no solution,keep what there is
+			}
+		}
+	}
+	applyImpulse(ar,A,B,r1[0],r2[0],(x1-a1)*n);
+	applyImpulse(ar,A,B,r1[1],r2[1],(x2-a2)*n);
+	c1.pn=x1,c2.pn=x2;
+}
+
+/* New arbiters for every pair with an awake body (all pairs for a fresh level,
+   to find how it rests),warm started from the old ones in ARBITERS or,for a
+   body that just woke,in RESTING. Bodies are kept sorted on the left edge of
+   their bounds; only awake ones move,so insertion sort is close to linear,and
+   only awake ones look for neighbours: forward up to their right edge,back as
+   far as the widest body reaches for sleeping ones. The awake ones are split
+   into regions along x that are searched in parallel */
+typedef struct sweepentry{
+	glm::vec4 b;                   //bounds: minx,maxx,miny,maxy
+	int id;
+	bool awake;
+}sweepentry;
+void findContacts(vector<int> *awake){     //NULL: everything
+	static vector<sweepentry> sweep;
+	static vector<int> slot;       //where each body is in sweep
+	static vector<int> active;     //sweep slots of the awake ones
+	static vector<vector<arbiter> > found;       //per thread
+	static vector<vector<long long> > woken;     //per thread,keys to take out of RESTING
+	static vector<arbiter> merged;
+	static float widest;
+	bool all=!awake;
+	if(all){
+		sweep.clear(),widest=0;
+		for(int i=0;i<OBSTACLES;++i)
+			if(allobstacles[i].dynamic){
+				sweepentry e={glm::vec4(0),i,true};
+				sweep.push_back(e);
+			}
+	}
+	else for(size_t i=0;i<sweep.size();++i)sweep[i].awake=false;
+	slot.resize(OBSTACLES);
+	for(size_t i=0;i<(all?sweep.size():awake->size());++i){
+		sweepentry &e=all?sweep[i]:sweep[slot[(*awake)[i]]];
+		obstacle &o=allobstacles[e.id];
+		float hw,hh;
+		o.extent(hw,hh);
+		e.b=glm::vec4(o.x-hw,o.x+hw,o.y-hh,o.y+hh),e.awake=true;
+		widest=max(widest,2*hw);
+	}
+	if(all)sort(sweep.begin(),sweep.end(),[](const sweepentry &l,const sweepentry &r){return l.b.x<r.b.x;});
+	else
+		for(size_t i=1;i<sweep.size();++i){
+			sweepentry e=sweep[i];
+			size_t j=i;
+			for(;j>0&&sweep[j-1].b.x>e.b.x;--j)sweep[j]=sweep[j-1];
+			sweep[j]=e;
+		}
+	active.clear();
+	for(size_t i=0;i<sweep.size();++i){
+		slot[sweep[i].id]=i;
+		if(sweep[i].awake)active.push_back(i);
+	}
+	found.resize(jobs.threads),woken.resize(jobs.threads);
+	for(int t=0;t<jobs.threads;++t)found[t].clear(),woken[t].clear();
+	jobs.parallelFor(active.size(),64,[all](int begin,int end){
+		vector<arbiter> &out=found[JOBSLOT];
+		size_t first=out.size();
+		arbiter ar;
+		for(int e=begin;e<end;++e){
+			size_t i=active[e];
+			int p=sweep[i].id;
+			glm::vec4 bp=sweep[i].b;
+			if(bp.z<=BODYGROUND+BODYMARGIN){
+				ar.a=-1,ar.b=p;
+				if((ar.n=collideGround(allobstacles[p],ar.c))>0)out.push_back(ar);
+			}
+			for(size_t j=i+1;j<sweep.size()&&sweep[j].b.x<=bp.y+BODYMARGIN;++j){
+				glm::vec4 &bq=sweep[j].b;
+				if(bq.z>bp.w+BODYMARGIN||bq.w<bp.z-BODYMARGIN)continue;
+				ar.a=min(p,sweep[j].id),ar.b=max(p,sweep[j].id);
+				if(!PASSTHROUGH.empty()&&binary_search(PASSTHROUGH.begin(),PASSTHROUGH.end(),arbiterkey(ar)))continue;
+				if((ar.n=collideBoxes(allobstacles[ar.a],allobstacles[ar.b],ar.c))>0)out.push_back(ar);
+			}
+			for(size_t j=i;!all&&j>0&&sweep[j-1].b.x>=bp.x-widest-BODYMARGIN;--j){
+				glm::vec4 &bq=sweep[j-1].b;    //awake ones found this pair going forward
+				if(sweep[j-1].awake||bq.y<bp.x-BODYMARGIN)continue;
+				if(bq.z>bp.w+BODYMARGIN||bq.w<bp.z-BODYMARGIN)continue;
+				ar.a=min(p,sweep[j-1].id),ar.b=max(p,sweep[j-1].id);
+				if(!PASSTHROUGH.empty()&&binary_search(PASSTHROUGH.begin(),PASSTHROUGH.end(),arbiterkey(ar)))continue;
+				if((ar.n=collideBoxes(allobstacles[ar.a],allobstacles[ar.b],ar.c))>0)out.push_back(ar);
+			}
+		}
+		for(size_t i=first;i<out.size();++i){      //warm start,old arbiters are only read here
+			arbiter &nw=out[i],*old=NULL;
+			vector<arbiter>::iterator it=lower_bound(ARBITERS.begin(),ARBITERS.end(),nw,arbiterless);
+			unordered_map<long long,arbiter>::iterator rest=RESTING.end();
+			if(it!=ARBITERS.end()&&arbiterkey(*it)==arbiterkey(nw))old=&*it;
+			else if(!RESTING.empty()&&(rest=RESTING.find(arbiterkey(nw)))!=RESTING.end())old=&rest->second;
+			if(!old)continue;
+			for(int k=0;k<nw.n;++k)
+				for(int m=0;m<old->n;++m)
+					if(nw.c[k].feature==old->c[m].feature)nw.c[k].pn=old->c[m].pn,nw.c[k].pt=old->c[m].pt;
+			if(rest!=RESTING.end())woken[JOBSLOT].push_back(rest->first);
+		}
+	});
+	merged.clear();
+	for(int t=0;t<jobs.threads;++t){
+		merged.insert(merged.end(),found[t].begin(),found[t].end());
+		for(size_t k=0;k<woken[t].size();++k)RESTING.erase(woken[t][k]);
+	}
+	sort(merged.begin(),merged.end(),arbiterless);
+	ARBITERS.swap(merged);
+}
+
+/* A sleeping body whose contacts this step would change its speed by more
+   than WAKESPEED wakes up and is solved from the next one. Lighter knocks,
+   and the weight of a similar block resting on it,leave it asleep. Called
+   once every island is solved; asleep means it was fixed (zero inverse mass)
+   while they were */
+void wakeKnocked(arbiter &ar){
+	bool aasleep=ar.a>=0&&ar.ma==0;
+	if(!aasleep&&ar.mb!=0)return;
+	obstacle &o=aasleep?allobstacles[ar.a]:allobstacles[ar.b];
+	glm::vec2 P(0,0);
+	for(int k=0;k<ar.n;++k)P+=ar.c[k].pn*ar.c[k].n+ar.c[k].pt*glm::vec2(ar.c[k].n.y,-ar.c[k].n.x);
+	if(glm::length(P)*o.invmass>WAKESPEED)o.wake();
+}
+/* Solve one island: contacts,then positions,then whether it may sleep */
+/* A large island is solved in parallel too. Its bodies are cut into REGIONS
+   strips along x; contacts inside a strip move only its bodies,so after the
+   few contacts across strips are solved on one thread the strips are solved
+   at the same time,each in order. The cut depends on the island only,not on the number
+   of threads,so every run gives the same result. Reorders bodies by x and arbs
+   by strip,fills start (one more than the groups) and returns the groups */
+const int REGIONMIN=1024;          //contacts,smaller islands are solved in order on one thread
+const int REGIONS=64;
+vector<int> REGION;                //per body,its strip in a large island
+int splitIsland(int *bodies,int nbodies,int *arbs,int narbs,int *start){
+	int regions=min(REGIONS,narbs/(REGIONMIN/2));
+	sort(bodies,bodies+nbodies,[](int l,int r){return allobstacles[l].x<allobstacles[r].x;});
+	for(int k=0;k<nbodies;++k)REGION[bodies[k]]=(long long)k*regions/nbodies;
+	static thread_local vector<int> group,sorted;
+	group.resize(narbs),sorted.resize(narbs);
+	for(int g=0;g<=regions+1;++g)start[g]=0;
+	for(int k=0;k<narbs;++k){
+		arbiter &ar=ARBITERS[arbs[k]];
+		int ra=ar.a>=0&&allobstacles[ar.a].awake?REGION[ar.a]:-1,rb=allobstacles[ar.b].awake?REGION[ar.b]:-1;
+		group[k]=ra<0?rb:rb<0||ra==rb?ra:regions;     //fixed bodies belong to no strip
+		start[group[k]+1]++;
+	}
+	for(int g=0;g<=regions;++g)start[g+1]+=start[g];
+	int at[REGIONS+1];
+	copy(start,start+regions+1,at);
+	for(int k=0;k<narbs;++k)sorted[at[group[k]]++]=arbs[k];
+	copy(sorted.begin(),sorted.end(),arbs);
+	return regions+1;
+}
+/* f on every contact: the last group,then all the others at once */
+template<typename F> void eachGroup(int *arbs,int *start,int groups,F f){
+	for(int k=start[groups-1];k<start[groups];++k)f(ARBITERS[arbs[k]]);
+	jobs.parallelFor(groups-1,1,[arbs,start,&f](int begin,int end){
+		for(int k=start[begin];k<start[end];++k)f(ARBITERS[arbs[k]]);
+	});
+}
+void solveIsland(int *bodies,int nbodies,int *arbs,int narbs,float dt){
+	int start[REGIONS+2]={0,narbs},groups=1;
+	if(narbs>=REGIONMIN)groups=splitIsland(bodies,nbodies,arbs,narbs,start);
+	eachGroup(arbs,start,groups,[dt](arbiter &ar){prestep(ar,1/dt);});
+	for(int it=0;it<BODYITERATIONS;++it)eachGroup(arbs,start,groups,solveContacts);
+	for(int it=0;it<BODYITERATIONS;++it)eachGroup(arbs,start,groups,solvePush);
+	float still=BODYSLEEPTIME;
+	for(int k=0;k<nbodies;++k){
+		obstacle &o=allobstacles[bodies[k]];
+		o.x+=dt*(o.velx+o.pushx),o.y+=dt*(o.vely+o.pushy),o.angle+=dt*(o.spin+o.pushspin);
+		o.pushx=o.pushy=o.pushspin=0;
+		if(o.velx*o.velx+o.vely*o.vely>SLEEPLINEAR*SLEEPLINEAR||fabs(o.spin)>SLEEPANGULAR)o.still=0;
+		else o.still+=dt;
+		still=min(still,o.still);
+	}
+	if(still<BODYSLEEPTIME)return;
+	for(int k=0;k<nbodies;++k){
+		obstacle &o=allobstacles[bodies[k]];
+		o.awake=false,o.velx=o.vely=o.spin=0;
+	}
+}
+int islandroot(vector<int> &parent,int i){
+	while(parent[i]!=i)i=parent[i]=parent[parent[i]];
+	return i;
+}
+/* One step of the rigid bodies. Awake bodies that touch are grouped into
+   islands with union-find,each solved on its own and put to sleep as a whole.
+   Sleeping bodies are not in any island: awake ones lean on them as if they
+   were fixed,so knocking one block wakes its neighbours only if it hits them.
+   Islands share nothing they write,so they are solved in parallel */
+typedef struct island{
+	int b0,b1,a0,a1;               //its ranges in bodies and arbs
+}island;
+void stepBodies(float dt){
+	bool any=false;
+	for(int i=0;i<OBSTACLES&&!any;++i)any=allobstacles[i].dynamic&&allobstacles[i].awake;
+	if(!any)return;                  //everything asleep costs one scan
+	static vector<int> parent,bodies,arbs,owner;
+	static vector<island> islands;
+	bodies.clear(),arbs.clear(),islands.clear();
+	for(int i=0;i<OBSTACLES;++i){
+		obstacle &o=allobstacles[i];
+		if(!o.dynamic||!o.awake)continue;
+		o.vely-=GRAVITY*dt;
+		bodies.push_back(i);
+	}
+	findContacts(&bodies);
+
+	parent.resize(OBSTACLES),owner.resize(ARBITERS.size());
+	for(size_t k=0;k<bodies.size();++k)parent[bodies[k]]=bodies[k];
+	for(size_t k=0;k<ARBITERS.size();++k){
+		arbiter &ar=ARBITERS[k];
+		bool aawake=ar.a>=0&&allobstacles[ar.a].awake,bawake=allobstacles[ar.b].awake;
+		if(!aawake&&!bawake)continue;
+		if(aawake&&bawake)parent[islandroot(parent,ar.a)]=islandroot(parent,ar.b);
+		owner[k]=bawake?ar.b:ar.a;
+		arbs.push_back(k);
+	}
+	sort(bodies.begin(),bodies.end(),[](int l,int r){return islandroot(parent,l)<islandroot(parent,r);});
+	sort(arbs.begin(),arbs.end(),[](int l,int r){return islandroot(parent,owner[l])<islandroot(parent,owner[r]);});
+
+	size_t b0=0,a0=0;
+	while(b0<bodies.size()){
+		int root=islandroot(parent,bodies[b0]);
+		size_t b1=b0,a1=a0;
+		while(b1<bodies.size()&&islandroot(parent,bodies[b1])==root)++b1;
+		while(a1<arbs.size()&&islandroot(parent,owner[arbs[a1]])==root)++a1;
+		island is={(int)b0,(int)b1,(int)a0,(int)a1};
+		islands.push_back(is);
+		b0=b1,a0=a1;
+	}
+	REGION.resize(OBSTACLES);
+	jobs.parallelFor(islands.size(),1,[dt](int begin,int end){
+		for(int i=begin;i<end;++i){
+			island &is=islands[i];
+			solveIsland(&bodies[is.b0],is.b1-is.b0,arbs.empty()?NULL:&arbs[is.a0],is.a1-is.a0,dt);
+		}
+	});
+	for(size_t k=0;k<arbs.size();++k)wakeKnocked(ARBITERS[arbs[k]]);
+	size_t n=0;
+	for(size_t k=0;k<ARBITERS.size();++k){      //islands that fell asleep leave their contacts at rest
+		arbiter &ar=ARBITERS[k];
+		if((ar.a<0||!allobstacles[ar.a].awake)&&!allobstacles[ar.b].awake)RESTING[arbiterkey(ar)]=ar;
+		else ARBITERS[n++]=ar;
+	}
+	ARBITERS.resize(n);
+}
+/* Step the bodies at BODYDT up to the game clock. After a stall (or a new
+   level) it starts from now instead of catching up */
+void advanceBodies(){
+	double now=gametime();
+	if(BODYTIME<0||now<BODYTIME||now-BODYTIME>0.1)BODYTIME=now-BODYDT;
+	while(now-BODYTIME>=BODYDT*0.999){
+		stepBodies(BODYDT);
+		BODYTIME+=BODYDT;
+	}
+}
+/* A new level: blocks and floors become bodies,asleep where they were placed,
+   and each target is attached to the floor under it */
+void settleBodies(){
+	for(int i=0;i<OBSTACLES;++i){
+		obstacle &o=allobstacles[i];
+		if(!o.target&&o.speed==0)o.makeDynamic();
+	}
+	for(int i=0;i<OBSTACLES;++i){
+		obstacle &o=allobstacles[i];
+		if(!o.target)continue;
+		for(int j=0;j<OBSTACLES;++j){
+			obstacle &f=allobstacles[j];
+			if(f.dynamic&&fabs(f.y+f.h/2.0-o.resty)<1&&fabs(o.restx-f.x)<=f.w/2.0){
+				o.floor=j,o.offx=o.restx-f.x;
+				break;
+			}
+		}
+	}
+	ARBITERS.clear(),RESTING.clear(),PASSTHROUGH.clear();
+	findContacts(NULL);
+	for(size_t k=0;k<ARBITERS.size();++k){    //generated towers go through each other,leave them so
+		arbiter &ar=ARBITERS[k];
+		bool deep=false;
+		for(int i=0;i<ar.n;++i)deep=deep||ar.c[i].sep<-BODYSLOP;
+		if(deep&&ar.a>=0)PASSTHROUGH.push_back(arbiterkey(ar));
+		else RESTING[arbiterkey(ar)]=ar;
+	}
+	sort(PASSTHROUGH.begin(),PASSTHROUGH.end());
+	ARBITERS.clear();
+	BODYTIME=-1;
+}
+int activeBalls(ball **out){
+	int n=0;
+	if(my.active())out[n++]=&my;
+	for(int k=0;k<fragments.count;++k)
+		if(fragments.balls[fragments.live[k]].active())out[n++]=&fragments.balls[fragments.live[k]];
+	return n;
+}
+/* A sliding ball keeps its contact while its centre is over the block */
+bool supported(ball &b){
+	if(b.support==ball::GROUNDED)return true;
+	obstacle &o=allobstacles[b.support];
+	return !o.awake&&fabs(b.x-o.x)<=o.w/2.0;
 }
 float camera_rotation_angle = 90;
 float rectangle_rotation = 0;
 float triangle_rotation = 0;
+/* Advance the world by one frame: targets, balls and collisions. No GL calls,
+   so it also runs headless (see bench.cpp) */
+void step ()
+{
+	profilescope physics(PHASE_PHYSICS);
+	advanceBodies();
+	translateTargets();               //to scale and translate targets
+	jobs.parallelFor(OBSTACLES,1024,[](int begin,int end){
+		for(int i=begin;i<end;++i){
+			if(!allobstacles[i].target||(allobstacles[i].target&&allobstacles[i].available))
+				allobstacles[i].update();
+		}
+	});
+	physics.stop();
+
+	static ball *moving[1+MAXFRAGMENTS];    //active set,main ball then fragments; sleeping balls cost nothing
+	int nmoving=activeBalls(moving);
+	profilescope collide(PHASE_COLLISION);
+	for(int j=0;j<nmoving;++j)gameground.checkCollision(*moving[j]);
+	collide.stop();
+
+	physics.start();
+	if(!my.isshoot&&LIFES>0)my.place(0,25+10+15,s);
+	else my.fire(s);
+	if(my.asleep)my.init();           //main ball at rest,reload
+	fragments.step(s);
+	particles.step();
+	for(int k=0;k<fragments.count;++k){    //the block under a sleeping fragment was knocked
+		ball &f=fragments.balls[fragments.live[k]];
+		if(f.asleep&&f.support>=0&&allobstacles[f.support].awake)
+			f.asleep=false,f.takeoff();
+	}
+	if(my.power)testpow.place();
+	nmoving=activeBalls(moving);
+	for(int j=0;j<nmoving;++j)
+		if(moving[j]->support!=ball::FLYING&&!supported(*moving[j]))moving[j]->takeoff();
+	physics.stop();
+
+	collide.start();
+	if(my.power){
+		for(int i=0;i<OBSTACLES;++i)testpow.hit(allobstacles[i]);
+	}
+	for(int i=0;i<OBSTACLES;++i){
+		if(!allobstacles[i].target){
+			for(int j=0;j<nmoving;++j)allobstacles[i].checkCollision(*moving[j]);
+		}
+		else {
+			for(int j=0;j<nmoving;++j)allobstacles[i].hit(*moving[j]);
+		}
+	}
+}
 /* Render the scene with openGL */
 /* Edit this function according to your assignment */
 void draw ()
 {
+	profilescope render(PHASE_RENDER);
+
 	// clear the color and depth in the frame buffer
 	glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 	// use the loaded shader program
 	// Don't change unless you know what you are doing
 	glUseProgram (programID);
+	vertexstream.begin();            //this frame's instance offsets,particles and HUD
 
-	// Eye - Location of camera. Don't change unless you are sure!!
-	glm::vec3 eye ( 5*cos(camera_rotation_angle*M_PI/180.0f), 0, 5*sin(camera_rotation_angle*M_PI/180.0f) );
-	// Target - Where is the camera looking at.  Don't change unless you are sure!!
-	glm::vec3 target (0+PANX, 0, 0);
-	// Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
-	glm::vec3 up (0, 1, 0);
-
-	// Compute Camera matrix (view)
-	// Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
-	//  Don't change unless you are sure!!
-	Matrices.view = glm::lookAt(glm::vec3(0+PANX,0,3), target, glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-
+	// View and projection are kept up to date by gamecamera
 	// Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
 	//  Don't change unless you are sure!!
 	glm::mat4 VP = Matrices.projection * Matrices.view;
@@ -1089,18 +3420,17 @@ void draw ()
 
 	// Pop matrix to undo transformations till last push matrix instead of recomputing model matrix
 	// glPopMatrix ();
-	gameground.draw();
-	gamesky.draw();
-	translateTargets();               //to scale and translate targets
-	for(int i=0;i<OBSTACLES;++i){
-		if(!allobstacles[i].target||(allobstacles[i].target&&allobstacles[i].available))
-			allobstacles[i].draw();
-	}
+	gputime.begin(GPU_STATIC);
+	staticlayer.update();
+	background.draw();
+	gputime.begin(GPU_OBSTACLES);
+	movingblocks.draw();
 	
 
 	// draw3DObject draws the VAO given to it using current MVP matrix
 	
 	
+	gputime.begin(GPU_CANNON);
 	Matrices.model = glm::mat4(1.0f);
 	glm::mat4 translateCircle = glm::translate (glm::vec3(-3.5*115,-3*115,0));
 	//glm::mat4 rotateCircle = glm::rotate (glm::vec3(0,0,1))
@@ -1117,7 +3447,7 @@ void draw ()
 	MVP = VP*Matrices.model;
 	glUniformMatrix4fv(Matrices.MatrixID,1,GL_FALSE,&MVP[0][0]);
 	//printf("%f\n",pipe_rot );
-	draw3DObject(pipe);
+	draw3DObject(barrel);
 
 	Matrices.model = glm::mat4(1.0f);
 	glm::mat4 scaleSpring = glm::scale(glm::vec3(1,s,1));
@@ -1129,48 +3459,26 @@ void draw ()
 	glUniformMatrix4fv(Matrices.MatrixID,1,GL_FALSE,&MVP[0][0]);
 	draw3DObject(spring);	
 	
-	for(int i=0;i<LIFES;++i){
-		drawCircle(life[i],-620+35*i,480);
-	}
-
-	gameground.checkCollision(my);
-	for(int j=0;j<2;++j)gameground.checkCollision(powerball[j]);  //check with other(power) balls
-	// for(int i=0;i<OBSTACLES;++i){
-	// 	if(!allobstacles[i].target)allobstacles[i].checkCollision(my);
-	// 	else allobstacles[i].hit(my);
-	// }
-	// allobstacles[0].checkCollision(my);
-	// allobstacles[1].checkCollision(my);
+	gputime.begin(GPU_HUD);
+	drawLives();
 	
 	float ang = pipe_rot*M_PI/180.0f;
-	if(!my.isshoot&&LIFES>0)my.draw(0,25+10+15,s);
-	else my.fire(s);
-	for(int i=0;i<2;++i){
-		if(powerball[i].isshoot){
-			powerball[i].fire(s);
-		}
-	}
-	if(my.power){
-		testpow.draw();
-		for(int i=0;i<OBSTACLES;++i)testpow.hit(allobstacles[i]);
-	}
-
-	for(int i=0;i<OBSTACLES;++i){
-		if(!allobstacles[i].target){
-			allobstacles[i].checkCollision(my);       //with main ball
-			for(int j=0;j<2;++j)allobstacles[i].checkCollision(powerball[j]);  //with power balls
-		}
-		else {
-			allobstacles[i].hit(my);                    //main ball
-			for(int j=0;j<2;++j)allobstacles[i].hit(powerball[j]);       //power balls
-		}
-	}
+	gputime.begin(GPU_BALLS);
+	my.draw();
+	fragments.draw();
+	if(my.power)testpow.draw();
+	gputime.begin(GPU_PARTICLES);
+	particles.draw();
+	gputime.end();
 	//printf("ang: %f\n",ang);
 	Matrices.model = glm::mat4(1.0f);
 	//glm::mat4 translateBall = glm::translate(glm::vec3(-1.8+2*sin(ang),-2+2*cos(ang),0));
 	//Matrices.model*=translateBall;
 	MVP = VP*Matrices.model;
 	glUniformMatrix4fv(Matrices.MatrixID,1,GL_FALSE,&MVP[0][0]);
+	gputime.endframe();
+	if(PROFILING)prof.draw();
+	vertexstream.end();
 
 	// // Render font on screen
 	// static int fontScale = 0;
@@ -1211,6 +3519,53 @@ void draw ()
 	// rectangle_rotation = rectangle_rotation + increments*rectangle_rot_dir*rectangle_rot_status;
 }
 
+/* How the main loop waits for the next frame (--pacing, --fps) */
+enum { PACE_VSYNC, PACE_UNCAPPED, PACE_CAPPED, PACE_ADAPTIVE };
+const char * PACENAMES[] = {"vsync", "uncapped", "capped", "adaptive"};
+typedef struct pacer{
+	int mode = PACE_VSYNC;
+	double fps = 60;             //cap for PACE_CAPPED
+	double next = 0;             //deadline of the next frame
+	double refresh = 1.0/60;     //seconds per refresh of the primary monitor,see monitors()
+	bool parse(const char *name){
+		for(int m=0;m<4;++m)
+			if(!strcmp(name,PACENAMES[m]))return mode=m,true;
+		return false;
+	}
+	int swapinterval(){
+		if(mode==PACE_VSYNC)return 1;
+		if(mode==PACE_ADAPTIVE){        //vsync,but late frames tear instead of waiting a whole refresh
+			if(glfwExtensionSupported("GLX_EXT_swap_control_tear")||glfwExtensionSupported("WGL_EXT_swap_control_tear"))return -1;
+			printf("Adaptive vsync not supported, using vsync\n");
+			mode=PACE_VSYNC;
+			return 1;
+		}
+		return 0;
+	}
+	double period(){             //time between presents,0 when there is no fixed rate
+		if(mode==PACE_CAPPED)return 1.0/fps;
+		if(mode==PACE_UNCAPPED)return 0;
+		return refresh;
+	}
+	void monitors(){             //when the window opens and when a monitor comes or goes,not every frame
+		const GLFWvidmode *vm=glfwGetVideoMode(glfwGetPrimaryMonitor());
+		refresh=vm&&vm->refreshRate>0?1.0/vm->refreshRate:1.0/60;
+	}
+	void wait(){                 //before the swap in capped mode: sleep most of the gap,spin the rest
+		if(mode!=PACE_CAPPED)return;
+		const double SPIN=0.002;     //sleeps overshoot by up to a scheduler tick
+		double now=glfwGetTime();
+		next+=1.0/fps;
+		if(next<now)next=now;        //fell behind,don't try to catch up
+		if(next-now>SPIN)std::this_thread::sleep_for(std::chrono::duration<double>(next-now-SPIN));
+		while(glfwGetTime()<next);
+	}
+}pacer;
+pacer pacing;
+void monitorcallback(GLFWmonitor* monitor,int event){
+	pacing.monitors();
+}
+
 /* Initialise glfw window, I/O callbacks and the renderer to use */
 /* Nothing to Edit here */
 GLFWwindow* initGLFW (int width, int height)
@@ -1236,7 +3591,11 @@ GLFWwindow* initGLFW (int width, int height)
 
 	glfwMakeContextCurrent(window);
 	gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
-	glfwSwapInterval( 1 );
+	glfwSwapInterval( pacing.swapinterval() );
+	pacing.monitors();
+	glfwSetMonitorCallback(monitorcallback);
+	if(pacing.mode==PACE_CAPPED)printf("Pacing: capped at %.0f fps\n",pacing.fps);
+	else printf("Pacing: %s\n",PACENAMES[pacing.mode]);
 
 	/* --- register callbacks with GLFW --- */
 
@@ -1262,8 +3621,55 @@ GLFWwindow* initGLFW (int width, int height)
 	glfwSetScrollCallback(window,scrollcallback);
 	return window;
 }
-void initlife(){
-	for(int i=0;i<5;++i)life[i]=createCircle(15,color(0,0,1));
+
+/* Surfaceless EGL context rendering into a width x height framebuffer object,
+   for machines without a display. Returns false when EGL is not usable */
+bool initEGL (int width, int height)
+{
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+	EGLDisplay display = EGL_NO_DISPLAY;
+	if (getPlatformDisplay)
+		display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	if (display == EGL_NO_DISPLAY)
+		display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL))
+		return false;
+	eglBindAPI(EGL_OPENGL_API);
+
+	EGLint contextattribs[] = {EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE};
+	EGLConfig config = EGL_NO_CONFIG_KHR;
+	if (!strstr(eglQueryString(display, EGL_EXTENSIONS), "EGL_KHR_no_config_context")) {
+		EGLint configattribs[] = {EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};
+		EGLint n = 0;
+		if (!eglChooseConfig(display, configattribs, &config, 1, &n) || n == 0)
+			return false;
+	}
+	EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextattribs);
+	if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+		return false;
+	if (!gladLoadGLLoader((GLADloadproc) eglGetProcAddress))
+		return false;
+
+	// No default framebuffer without a surface, draw into our own
+	GLuint fbo, rbo[2];
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glGenRenderbuffers(2, rbo);
+	glBindRenderbuffer(GL_RENDERBUFFER, rbo[0]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, rbo[0]);
+	glBindRenderbuffer(GL_RENDERBUFFER, rbo[1]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, rbo[1]);
+	return glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+}
+void initlife(){           //made once: the VAO has attribute 2 per instance,as fragmentpool::create
+	if(lives)return;
+	lives=createCircle(15,color(0,0,1));
+	if(HEADLESS)return;
+	glBindVertexArray(lives->VertexArrayID);
+	glVertexAttribDivisor(2,1);
 }
 
 void createFloors(){
@@ -1279,50 +3685,471 @@ void createFloors(){
 	allobstacles[9].translate=glm::translate(glm::vec3(800,150,0));
 }
 void createTargets(){
-	allobstacles[3].create(50.0,50.0,color(0.9607,0.5529,0.1137),true,true);
-	allobstacles[4].create(50.0,50.0,color(0.9607,0.5529,0.1137),true,true);
+	allobstacles[3].create(50.0,50.0,TARGETCOLOR,true,true);
+	allobstacles[3].restx=550,allobstacles[3].resty=-300+25;         //floor 0
+	allobstacles[4].create(50.0,50.0,TARGETCOLOR,true,true);
+	allobstacles[4].restx=800,allobstacles[4].resty=-300+25;         //floor 0
+
+	allobstacles[6].create(50.0,50.0,TARGETCOLOR,true,true);
+	allobstacles[6].restx=950,allobstacles[6].resty=-150+25;         //floor 1
 
-	allobstacles[6].create(50.0,50.0,color(0.9607,0.5529,0.1137),true,true);
+	allobstacles[8].create(50.0,50.0,TARGETCOLOR,true,true);
+	allobstacles[8].restx=700,allobstacles[8].resty=-50+25;          //floor 2
 
-	allobstacles[8].create(50.0,50.0,color(0.9607,0.5529,0.1137),true,true);
+	allobstacles[10].create(50.0,50.0,TARGETCOLOR,true,true);
+	allobstacles[10].restx=700,allobstacles[10].resty=150+25;        //floor 3
+	allobstacles[11].create(50.0,50.0,TARGETCOLOR,true,true);
+	allobstacles[11].restx=950,allobstacles[11].resty=150+25;        //floor 3
+}
+
+/* Levels other than the built-in one, as text with one object per line:
+     block  <w> <h> <x> <y>           static rectangle centred at x,y
+     wall   <w> <h> <x> <y> <speed>   rectangle moving up and down
+     target <r> <x> <y>               circle resting on a floor at x,y
+   '#' starts a comment. Written by --generate, read by --level */
+typedef struct levelobject{
+	char kind;           //'b'lock,'w'all,'t'arget
+	float w,h,x,y,speed;
+}levelobject;
+vector<levelobject> LEVEL;       //empty for the built-in level
+const char * LEVELFILE = NULL;   // --level <file>
+unsigned long long SEED = 1;     // --seed <n>, for --stress and --generate
+
+/* n obstacles in towers of stacked blocks, floors carrying targets and moving
+   walls, between the cannon and the right edge. Sizes and positions are whole
+   or half units and speeds tenths, so a written level reads back exactly */
+vector<levelobject> generateLevel(unsigned long long seed,int n){
+	vector<levelobject> level;
+	rng r(seed);
+	const float GROUNDY=-325,TOP=480,LEFT=150,RIGHT=1280;
+	while((int)level.size()<n){
+		int kind=r.range(0,9);
+		float x=roundf(r.uniform(LEFT,RIGHT));
+		if(kind<7){                                   //tower
+			float w=r.range(10,40),h=r.range(10,40);
+			int levels=r.range(1,40);
+			for(int k=0;k<levels&&(int)level.size()<n;++k){
+				float y=GROUNDY+h/2+k*h;
+				if(y+h/2>TOP)break;
+				levelobject o={'b',w,h,x,y,0};
+				level.push_back(o);
+			}
+		}
+		else if(kind<9){                              //floor with targets on top
+			float w=r.range(100,400),h=20,y=roundf(r.uniform(-250,400));
+			levelobject f={'b',w,h,x,y,0};
+			level.push_back(f);
+			int targets=r.range(1,3);
+			for(int k=0;k<targets&&(int)level.size()<n;++k){
+				float rad=r.range(10,25);
+				levelobject t={'t',rad,rad,roundf(x-w/2+(k+0.5f)*w/targets),y+h/2,0};
+				level.push_back(t);
+			}
+		}
+		else{                                         //moving wall, starts centred like the built-in ones
+			float speed=roundf(r.uniform(0.5,3)*10)/10;
+			levelobject o={'w',(float)r.range(20,50),(float)r.range(100,200),x,0,speed};
+			level.push_back(o);
+		}
+	}
+	return level;
+}
+
+bool writeLevel(const char *path,vector<levelobject> &level){
+	FILE *out=fopen(path,"w");
+	if(!out){
+		printf("Could not write level %s\n",path);
+		return false;
+	}
+	fprintf(out,"# %d objects\n",(int)level.size());
+	for(size_t i=0;i<level.size();++i){
+		levelobject &o=level[i];
+		if(o.kind=='b')fprintf(out,"block %g %g %g %g\n",o.w,o.h,o.x,o.y);
+		else if(o.kind=='w')fprintf(out,"wall %g %g %g %g %g\n",o.w,o.h,o.x,o.y,o.speed);
+		else fprintf(out,"target %g %g %g\n",o.w,o.x,o.y);
+	}
+	fclose(out);
+	return true;
+}
 
-	allobstacles[10].create(50.0,50.0,color(0.9607,0.5529,0.1137),true,true);
-	allobstacles[11].create(50.0,50.0,color(0.9607,0.5529,0.1137),true,true);
+bool loadLevel(const char *path,vector<levelobject> &level){
+	ifstream in(path);
+	if(!in.is_open()){
+		printf("Could not open level %s\n",path);
+		return false;
+	}
+	level.clear();
+	string line;
+	for(int n=1;getline(in,line);++n){
+		line=line.substr(0,line.find('#'));
+		istringstream words(line);
+		string kind;
+		if(!(words>>kind))continue;
+		levelobject o={kind[0],0,0,0,0,0};
+		bool ok;
+		if(kind=="block")ok=(bool)(words>>o.w>>o.h>>o.x>>o.y);
+		else if(kind=="wall")ok=(bool)(words>>o.w>>o.h>>o.x>>o.y>>o.speed);
+		else if(kind=="target")ok=(bool)(words>>o.w>>o.x>>o.y),o.h=o.w;
+		else ok=false;
+		if(!ok){
+			printf("%s:%d: cannot read '%s'\n",path,n,line.c_str());
+			return false;
+		}
+		level.push_back(o);
+	}
+	return true;
 }
-void translateTargets(){
-	allobstacles[3].translate = glm::translate(glm::vec3(550,-300+25+allobstacles[3].r,0));  //floor 0
-	allobstacles[4].translate = glm::translate(glm::vec3(800,-300+25+allobstacles[4].r,0));  //floor 0
 
-	allobstacles[6].translate = glm::translate(glm::vec3(950,-150+25+allobstacles[6].r,0));  //floor 1
+void buildLevel(vector<levelobject> &level){
+	delete[] allobstacles;
+	allobstacles = new obstacle[max((int)level.size(),20)];
+	OBSTACLES=level.size(),TARGETS=0;
+	for(int i=0;i<OBSTACLES;++i){
+		levelobject &l=level[i];
+		obstacle &o=allobstacles[i];
+		if(l.kind=='t'){
+			o.create(l.w,l.w,TARGETCOLOR,true,true);
+			o.restx=l.x,o.resty=l.y;
+			TARGETS++;
+		}
+		else if(l.kind=='w'){
+			o.create(l.w,l.h,color(0.7,0.1,0.0),false,false);
+			o.translate=glm::translate(glm::vec3(l.x,0,0));
+			o.translateagain=glm::translate(glm::vec3(0,l.y,0));
+			o.speed=l.speed;
+		}
+		else{
+			o.create(l.w,l.h,color(0.5,0.2,0.0),false,false);
+			o.translate=glm::translate(glm::vec3(l.x,l.y,0));
+		}
+	}
+}
+void translateTargets(){          //targets sit on their floor,r shrinks after the first hit
+	for(int i=0;i<OBSTACLES;++i){
+		obstacle &o=allobstacles[i];
+		if(!o.target)continue;
+		if(o.floor<0){
+			o.translate = glm::translate(glm::vec3(o.restx,o.resty+o.r,0));
+			continue;
+		}
+		obstacle &f=allobstacles[o.floor];         //rides on it as it slides and tilts
+		float c=cos(f.angle),s=sin(f.angle),up=f.h/2.0+o.r;
+		o.translate = glm::translate(glm::vec3(f.x+c*o.offx-s*up,f.y+s*o.offx+c*up,0));
+	}
+}
+void moveWalls(float frames){      //speeds are per 1/60 s frame
+	jobs.parallelFor(OBSTACLES,1024,[frames](int begin,int end){
+		for(int i=begin;i<end;++i)
+			if(allobstacles[i].speed!=0)allobstacles[i].move(allobstacles[i].speed*frames);
+	});
+}
 
-	allobstacles[8].translate = glm::translate(glm::vec3(700,-50+25+allobstacles[8].r,0));   //floor 2
+/* Headless shot simulation (--simulate). Between impacts the ball is exactly on
+   its parabola x = x0+vx*t, y = y0+vy*t-100*t*t, so instead of stepping frames
+   the next impact with the ground, a block or a target is solved for and the
+   simulation jumps straight to it. Moving walls change height once a frame
+   (obstacle::move), so only they are checked one frame interval at a time.
+   Responses follow the game's rules; the world itself is not modified */
+const double BALLGROUND=-300;        //ball::onground
+
+typedef struct arc{                  //free flight starting at time t0
+	double x0,y0,vx,vy,t0;
+	double x(double t){return x0+vx*(t-t0);}
+	double y(double t){double u=t-t0; return y0+vy*u-GRAVITY/2*u*u;}
+	double vely(double t){return vy-GRAVITY*(t-t0);}
+}arc;
+
+int solveQuadratic(double a,double b,double c,double r[2]){
+	if(fabs(a)<1e-12){
+		if(fabs(b)<1e-12)return 0;
+		r[0]=-c/b;
+		return 1;
+	}
+	double d=b*b-4*a*c;
+	if(d<0)return 0;
+	double q=-0.5*(b+(b>=0?sqrt(d):-sqrt(d)));     //no cancellation
+	r[0]=q/a;
+	if(q==0)return 1;
+	r[1]=c/q;
+	return 2;
+}
+int solveCubic(double a,double b,double c,double d,double r[3]){
+	if(fabs(a)<1e-12)return solveQuadratic(b,c,d,r);
+	b/=a,c/=a,d/=a;                               //depressed cubic x = y - b/3
+	double p=c-b*b/3,q=2*b*b*b/27-b*c/3+d,shift=-b/3;
+	double disc=q*q/4+p*p*p/27;
+	if(disc>0){
+		double sq=sqrt(disc);
+		r[0]=cbrt(-q/2+sq)+cbrt(-q/2-sq)+shift;
+		return 1;
+	}
+	if(fabs(p)<1e-12){
+		r[0]=cbrt(-q)+shift;
+		return 1;
+	}
+	double m=2*sqrt(-p/3),th=acos(max(-1.0,min(1.0,3*q/(p*m))))/3;
+	for(int k=0;k<3;++k)r[k]=m*cos(th-2*M_PI*k/3)+shift;
+	return 3;
+}
 
-	allobstacles[10].translate = glm::translate(glm::vec3(700,150+25+allobstacles[10].r,0));  //floor 3
-	allobstacles[11].translate = glm::translate(glm::vec3(950,150+25+allobstacles[11].r,0));  //floor 3
+/* First time in (lo,hi] the ball centre enters the box (already grown by the
+   ball radius) through a face it is moving towards. face: 0 left 1 right 2 bottom 3 top */
+double hitBox(arc &a,double cx,double cy,double hw,double hh,double lo,double hi,int &face){
+	double best=-1,r[2];
+	double x0=cx-hw,x1=cx+hw,y0=cy-hh,y1=cy+hh;
+	if(a.vx!=0){
+		double t=a.t0+((a.vx>0?x0:x1)-a.x0)/a.vx,y=a.y(t);
+		if(t>lo&&t<=hi&&y>=y0&&y<=y1)best=t,face=a.vx>0?0:1;
+	}
+	for(int f=2;f<4;++f){
+		int n=solveQuadratic(-GRAVITY/2,a.vy,a.y0-(f==2?y0:y1),r);
+		for(int i=0;i<n;++i){
+			double t=a.t0+r[i],x=a.x(t),vy=a.vely(t);
+			if(t>lo&&t<=hi&&(best<0||t<best)&&x>=x0&&x<=x1&&(f==2?vy>0:vy<0))best=t,face=f;
+		}
+	}
+	return best;
+}
 
+/* First time in (lo,hi] the ball centre comes within R of (cx,cy). The squared
+   distance is a quartic in t; between the real roots of its derivative it is
+   monotonic, so each piece has at most one crossing, found by bisection */
+double hitCircle(arc &a,double cx,double cy,double R,double lo,double hi){
+	double A=a.y0-cy,B=a.vy,C=-GRAVITY/2,D=a.x0-cx,E=a.vx;
+	double k[5]={C*C,2*B*C,B*B+2*A*C+E*E,2*A*B+2*D*E,A*A+D*D-R*R};
+	#define QUARTIC(u) ((((k[0]*(u)+k[1])*(u)+k[2])*(u)+k[3])*(u)+k[4])
+	double ulo=lo-a.t0,uhi=hi-a.t0,cr[3],cuts[5];
+	int n=solveCubic(4*k[0],3*k[1],2*k[2],k[3],cr),m=0;
+	cuts[m++]=ulo;
+	sort(cr,cr+n);
+	for(int i=0;i<n;++i)if(cr[i]>ulo&&cr[i]<uhi)cuts[m++]=cr[i];
+	cuts[m++]=uhi;
+	for(int i=0;i+1<m;++i){
+		double l=cuts[i],h=cuts[i+1];
+		if(QUARTIC(l)<=0||QUARTIC(h)>0)continue;   //not entering on this piece
+		for(int it=0;it<60&&h-l>1e-10;++it){
+			double mid=(l+h)/2;
+			if(QUARTIC(mid)>0)l=mid;
+			else h=mid;
+		}
+		return a.t0+h;
+	}
+	#undef QUARTIC
+	return -1;
+}
 
+typedef struct simbody{
+	double x,y,hw,hh,r;
+	bool circle,target,hit;
+	float speed;
+	bool dir;
+	vector<float> track;           //height of a moving wall at each frame
+	double yat(int frame){         //replays obstacle::move one frame at a time
+		while((int)track.size()<=frame){
+			float y=track.back(),ny=dir?y+speed:y-speed;
+			if(ny>=200&&dir)dir=0;
+			if(ny<=-200&&!dir)dir=1;
+			track.push_back(ny);
+		}
+		return track[frame];
+	}
+}simbody;
+typedef struct simimpact{
+	double t,x,y;
+	char kind;                     //'g'round,'b'lock,'t'arget,'o'ut of window
+}simimpact;
+typedef struct shotresult{
+	double t,x,y;                  //where and when the shot ended
+	int impacts,targets;
+	char end;                      //'r'est (stopped),'o'ut of window,'t'ime limit
+}shotresult;
+
+/* Time for a ball sliding from x at speed v, slowed by dec, to reach edge; -1 if it stops first */
+double slideTo(double x,double v,double dec,double edge){
+	double d=fabs(edge-x);
+	if(v==0||(edge-x)*v<0||d>v*v/(2*dec))return -1;
+	return (fabs(v)-sqrt(v*v-2*dec*d))/dec;
+}
 
+/* One shot from (x,y), solved impact to impact up to tmax seconds. Blocks and
+   floors are fixed boxes here (tilted ones by their extent): a hit bounces the
+   ball but never moves, topples or wakes them, so on levels with stacks the
+   result can differ from real play, where they are rigid bodies */
+shotresult simulateShot(double x,double y,double vx,double vy,double r,double tmax,vector<simimpact> *log){
+	static vector<simbody> bodies;   //reused,no allocation per shot once warm
+	bodies.resize(OBSTACLES);
+	int nb=0;
+	for(int i=0;i<OBSTACLES;++i){
+		obstacle &o=allobstacles[i];
+		if(o.target&&!o.available)continue;
+		simbody &b=bodies[nb++];
+		b.x=o.x,b.y=o.y,b.circle=o.circle,b.target=o.target,b.hit=false;
+		float hw,hh;
+		o.extent(hw,hh);               //a tilted block counts as its bounds,the sim has no rotated boxes
+		b.r=o.r,b.hw=hw,b.hh=hh;
+		b.speed=o.speed,b.dir=o.dir;
+		b.track.clear();
+		if(o.speed!=0)b.track.push_back(o.y);
+	}
+	arc a={x,y,vx,vy,0};
+	shotresult res={0,x,y,0,0,'t'};
+	double t=0,u[2];
+	while(res.impacts<1000){
+		double best=tmax;
+		char kind=0;
+		int which=-1,face=-1,f;
+		if(a.vx!=0){                  //leaving the window ends the shot (ball::fire)
+			double te=a.t0+((a.vx>0?1300:-650)-a.x0)/a.vx;
+			if(te>t&&te<best)best=te,kind='o';
+		}
+		int n=solveQuadratic(-GRAVITY/2,a.vy,a.y0-BALLGROUND,u);
+		for(int i=0;i<n;++i){         //ground,only while falling
+			double tg=a.t0+u[i];
+			if(tg>t&&tg<best&&a.vely(tg)<0)best=tg,kind='g';
+		}
+		for(int i=0;i<nb;++i){
+			simbody &b=bodies[i];
+			double th=-1;
+			if(b.target){
+				if(!b.hit)th=hitCircle(a,b.x,b.y,b.r+r,t,best),f=-1;
+			}
+			else if(b.speed==0)th=hitBox(a,b.x,b.y,b.hw+r,b.hh+r,t,best,f);
+			else{                     //walls only move vertically, so only the frames the ball spends in their column matter
+				double lo=t,hi=best,xl=b.x-b.hw-r,xr=b.x+b.hw+r;
+				if(a.vx==0){
+					if(a.x0<xl||a.x0>xr)continue;
+				}
+				else{
+					double ta=a.t0+(xl-a.x0)/a.vx,tb=a.t0+(xr-a.x0)/a.vx;
+					lo=max(lo,min(ta,tb)),hi=min(hi,max(ta,tb));
+				}
+				if(lo>hi)continue;
+				for(int k=(int)(lo*60);k/60.0<=hi&&th<0;++k)
+					th=hitBox(a,b.x,b.yat(k),b.hw+r,b.hh+r,max(t,k/60.0),min((k+1)/60.0,best),f);
+			}
+			if(th>0&&th<best)best=th,kind=b.target?'t':'b',which=i,face=f;
+		}
+		if(!kind){                    //nothing before the time limit
+			t=tmax;
+			break;
+		}
+		t=best;
+		double px=a.x(t),py=a.y(t),pvx=a.vx,pvy=a.vely(t);
+		res.impacts++;
+		if(log){
+			simimpact e={t,px,py,kind};
+			log->push_back(e);
+		}
+		if(kind=='o'){
+			res.end='o';
+			break;
+		}
+		if(kind=='g'){                //ground::checkCollision
+			float fx=pvx,fy=pvy;
+			impulse(fx,fy,0,1,GROUNDBOUNCE,GROUNDFRICTION);
+			pvx=fx,pvy=fy;
+			if(fy<RESTSPEED){         //ball::land,slides until it stops,bouncing off the sides of blocks on the way
+				double dec=GROUNDFRICTION*GRAVITY;
+				res.end=0;
+				while(!res.end){
+					double edge=pvx>0?1300:-650,te=slideTo(px,pvx,dec,edge);
+					int wall=-1;
+					for(int i=0;i<nb;++i){
+						simbody &b=bodies[i];
+						if(b.target||b.speed!=0||fabs(BALLGROUND-b.y)>b.hh+r)continue;
+						double side=b.x+(pvx>0?-b.hw-r:b.hw+r),ts=slideTo(px,pvx,dec,side);
+						if(ts>=0&&(te<0||ts<te))te=ts,edge=side,wall=i;
+					}
+					if(te<0){
+						t+=fabs(pvx)/dec,px+=pvx*fabs(pvx)/(2*dec);
+						res.end='r';
+					}
+					else{
+						t+=te,px=edge,pvx-=(pvx>0?dec:-dec)*te;
+						if(wall<0)res.end='o';
+						else pvx*=-BLOCKBOUNCE,res.impacts++;
+					}
+				}
+				arc still={px,BALLGROUND,0,0,t};
+				a=still;
+				break;
+			}
+		}
+		else if(kind=='b'){           //obstacle::checkCollision,off the face hit
+			float fx=pvx,fy=pvy;
+			impulse(fx,fy,face==0?-1:face==1?1:0,face==2?-1:face==3?1:0,BLOCKBOUNCE,BLOCKFRICTION);
+			pvx=fx,pvy=fy;
+			simbody &b=bodies[which];
+			if(face==3&&b.speed==0&&fy<RESTSPEED){    //lands on top,slides off the edge or stops there
+				double dec=BLOCKFRICTION*GRAVITY,edge=b.x+(pvx>0?b.hw:-b.hw),te=slideTo(px,pvx,dec,edge);
+				if(te<0){
+					t+=fabs(pvx)/dec,px+=pvx*fabs(pvx)/(2*dec);
+					res.end='r';
+					arc still={px,py,0,0,t};
+					a=still;
+					break;
+				}
+				t+=te,px=edge,pvx-=(pvx>0?dec:-dec)*te,pvy=0;
+			}
+		}
+		else{                         //obstacle::hit,the ball flies on
+			bodies[which].hit=true;
+			res.targets++;
+		}
+		arc next={px,py,pvx,pvy,t};
+		a=next;
+	}
+	res.t=t,res.x=a.x(t),res.y=a.y(t);
+	return res;
 }
 void initObjects(){           //improve
 	my.x=my.y=0,my.r=0.15*100;
 	my.create(color(0,0,1));
-	for(int i=0;i<2;++i)powerball[i].r=15;
-		for(int i=0;i<2;++i)powerball[i].create(color(0.309,0.047,0.96));
+	fragments.create(color(0.309,0.047,0.96));
 	gameground.create();
 	gamesky.create();
-	OBSTACLES = 12;
-	float r = 50;
-	createFloors();
-	createTargets();
-	//translateTargets();
-	allobstacles[0].create(50.0,200.0,color(0.7,0.1,0.0),false,false);      //movable
-	allobstacles[0].translate = glm::translate(glm::vec3(-100,0,0));
-	allobstacles[1].create(50.0,200.0,color(0.7,0.1,0.0),false,false);        //movable
-	allobstacles[1].translate=glm::translate(glm::vec3(100,0,0));
+	if(!LEVEL.empty())buildLevel(LEVEL);
+	else{
+		OBSTACLES = 12,TARGETS = 6;
+		float r = 50;
+		createFloors();
+		createTargets();
+		//translateTargets();
+		allobstacles[0].create(50.0,200.0,color(0.7,0.1,0.0),false,false);      //movable
+		allobstacles[0].translate = glm::translate(glm::vec3(-100,0,0));
+		allobstacles[0].speed = 1.0;
+		allobstacles[1].create(50.0,200.0,color(0.7,0.1,0.0),false,false);        //movable
+		allobstacles[1].translate=glm::translate(glm::vec3(100,0,0));
+		allobstacles[1].speed = 2.0;
+	}
+	settleBodies();
+	staticlayer.build();
 	testpow.create(10.0,3);
 	createPipe();
 	createSpring();
 }
+void restartLevel(){            //recreate all objects,old GL buffers are recycled through gpumem
+	initObjects();
+	initlife();
+	SCORE=0,LIFES=5,BALLCOUNT=0;
+	my.init();
+	fragments.clear();
+	particles.clear();
+	gpumem.print();
+}
+void mainProgramSwapped(GLuint program){
+	Matrices.MatrixID = glGetUniformLocation(program, "MVP");
+	background.dirty = true;         //staticlayer is drawn with this program
+}
+void backgroundProgramSwapped(GLuint program){
+	background.OffsetID = glGetUniformLocation(program, "offset");
+	background.ScaleID = glGetUniformLocation(program, "scale");
+	background.dirty = true;
+}
+void particleProgramSwapped(GLuint program){
+	particles.MatrixID = glGetUniformLocation(program, "MVP");
+	particles.SizeID = glGetUniformLocation(program, "size");
+}
 /* Initialize the OpenGL rendering properties */
 /* Add all the models to be created here */
 void initGL (GLFWwindow* window, int width, int height)
@@ -1340,9 +4167,23 @@ void initGL (GLFWwindow* window, int width, int height)
 	programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
 	// Get a handle for our "MVP" uniform
 	Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
+	particles.program = LoadShaders( "Particle.vert", "Sample_GL.frag" );
+	particleProgramSwapped(particles.program);
+	background.program = LoadShaders( "Background.vert", "Background.frag" );
+	backgroundProgramSwapped(background.program);
+	vertexstream.create();
+	particles.create();
+	background.create();
+	gputime.init();
+	if(SHADERDIR){           //reload shaders when they are edited
+		shaderwatch.add("Sample_GL.vert", "Sample_GL.frag", &programID, mainProgramSwapped);
+		shaderwatch.add("Particle.vert", "Sample_GL.frag", &particles.program, particleProgramSwapped);
+		shaderwatch.add("Background.vert", "Background.frag", &background.program, backgroundProgramSwapped);
+		shaderwatch.start();
+	}
 
 
-	reshapeWindow (window, width, height);
+	gamecamera.init(window,width,height);
 
 	// Background color of the scene
 	glClearColor (0.3f, 0.3f, 0.3f, 0.0f); // R, G, B, A
@@ -1383,95 +4224,238 @@ void initGL (GLFWwindow* window, int width, int height)
 	cout << "GLSL: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << endl;
 }
 
+void createStressLevel(int n){      //generated level of n obstacles,the built-in one when n<=0
+	if(n>0)LEVEL=generateLevel(SEED,n);
+	else LEVEL.clear();
+	initObjects();
+}
+
+/* Render OFFSCREEN frames of a scripted camera path through the stress level and
+   report throughput. Runs on a fixed clock so every run sees the same frames */
+void runOffscreen(int width, int height)
+{
+	if(!initEGL(width,height)){
+		printf("Could not create a surfaceless EGL context\n");
+		exit(EXIT_FAILURE);
+	}
+	initGL(NULL,width,height);
+	SIMCLOCK=0;
+	long calls=DRAWCALLS;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for(int f=0;f<OFFSCREEN;++f){
+		if(PROFILING)prof.endframe();
+		TRACE("frame");
+		SIMCLOCK+=1.0/60;
+		if(!my.isshoot){              //keep a ball in flight
+			my.place(0,25+10+15,1);
+			my.shoot(0.8);
+		}
+		step();
+		float t=(float)f/OFFSCREEN;   //pan across the level and back, zooming out half way
+		PANX=325*(1-cos(2*M_PI*t));
+		ZOOM=1+0.5*sin(M_PI*t);
+		gamecamera.update(1.0/60);
+		draw();
+		clearcollisions(my);
+		moveWalls(1);
+	}
+	glFinish();
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	printf("offscreen: %d frames, %d obstacles, %.3f s, %.1f fps, %.1f draw calls/frame\n",
+		OFFSCREEN, OBSTACLES, secs, OFFSCREEN/secs, (double)(DRAWCALLS-calls)/max(OFFSCREEN,1));
+	printf("background: drawn %d times\n",background.renders);
+	if(vertexstream.stalls)printf("vertex stream: %ld frames waited for the GPU\n",vertexstream.stalls);
+	if(vertexstream.dropped)printf("vertex stream: %ld draws did not fit and were skipped\n",vertexstream.dropped);
+	prof.finish();
+	trace.write(TRACEFILE);
+	shaderwatch.finish();
+	jobs.finish();
+	gpumem.shutdown();
+}
+
+/* Simulate a shot for every cannon angle without GL and print where each one
+   ends, then time the whole sweep */
+void runSimulation()
+{
+	HEADLESS=true;
+	SIMCLOCK=0;
+	initObjects();
+	translateTargets();
+	for(int i=0;i<OBSTACLES;++i)allobstacles[i].update();
+	my.init();
+	vector<double> sx,sy,svx,svy;
+	printf("%6s %8s %8s %8s %10s %10s\n","angle","time","impacts","targets","end x","end");
+	for(int rot=-85;rot<=-5;++rot){
+		pipe_rot=rot;
+		my.place(0,25+10+15,1);
+		double ang=0.5*M_PI+pipe_rot*M_PI/180;
+		sx.push_back(my.x),sy.push_back(my.y),svx.push_back(my.vel*cos(ang)),svy.push_back(my.vel*sin(ang));
+		shotresult r=simulateShot(my.x,my.y,my.vel*cos(ang),my.vel*sin(ang),my.r,60,NULL);
+		printf("%6d %8.3f %8d %8d %10.1f %10s\n",rot,r.t,r.impacts,r.targets,r.x,r.end=='r'?"rest":r.end=='o'?"out":"time limit");
+	}
+	int shots=0;
+	std::chrono::steady_clock::time_point start=std::chrono::steady_clock::now();
+	double secs=0;
+	while(secs<0.5){
+		for(size_t i=0;i<sx.size();++i,++shots)simulateShot(sx[i],sy[i],svx[i],svy[i],my.r,60,NULL);
+		secs=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+	}
+	printf("%d shots against %d obstacles in %.3f s, %.2f us/shot\n",shots,OBSTACLES,secs,secs*1e6/shots);
+}
+
+#ifndef ANGRYBIRDS_NO_MAIN      //bench.cpp includes this file for its globals
 int main (int argc, char** argv)
 {
 	int width = 1300;
 	int height = 1000;
 	int MOUSEPRESSED=0;
 	float tmp=0;
+	int generate=0;
+	const char * generatefile=NULL;
+	for(int i=1;i<argc;++i){
+		if(!strcmp(argv[i],"--shaders")&&i+1<argc)SHADERDIR=argv[++i];
+		if(!strcmp(argv[i],"--profile")&&i+1<argc)PROFILEFILE=argv[++i],PROFILING=true;
+		if(!strcmp(argv[i],"--trace")&&i+1<argc)TRACEFILE=argv[++i],trace.start();
+		if(!strcmp(argv[i],"--offscreen")&&i+1<argc)OFFSCREEN=atoi(argv[++i]);
+		if(!strcmp(argv[i],"--stress")&&i+1<argc)STRESS=atoi(argv[++i]);
+		if(!strcmp(argv[i],"--seed")&&i+1<argc)SEED=strtoull(argv[++i],NULL,10);
+		if(!strcmp(argv[i],"--level")&&i+1<argc)LEVELFILE=argv[++i];
+		if(!strcmp(argv[i],"--generate")&&i+2<argc)generate=atoi(argv[++i]),generatefile=argv[++i];
+		if(!strcmp(argv[i],"--pacing")&&i+1<argc&&!pacing.parse(argv[++i])){
+			printf("Unknown pacing %s, use vsync, uncapped, capped or adaptive\n",argv[i]);
+			return 1;
+		}
+		if(!strcmp(argv[i],"--simulate"))SIMULATE=true;
+		if(!strcmp(argv[i],"--lowlatency"))LOWLATENCY=true;
+		if(!strcmp(argv[i],"--predict"))PREDICT=LOWLATENCY=true;
+		if(!strcmp(argv[i],"--fps")&&i+1<argc)pacing.fps=max(1.0,atof(argv[++i])),pacing.mode=PACE_CAPPED;
+		if(!strcmp(argv[i],"--threads")&&i+1<argc)THREADS=atoi(argv[++i]);
+		if(!strcmp(argv[i],"--orphan"))ORPHAN=true;
+		if(!strcmp(argv[i],"--split")&&i+1<argc)SPLIT=max(1,min(MAXFRAGMENTS,atoi(argv[++i])));
+	}
+	if(generatefile){             //write a level and exit
+		vector<levelobject> level=generateLevel(SEED,generate);
+		return writeLevel(generatefile,level)?0:1;
+	}
+	if(LEVELFILE&&!loadLevel(LEVELFILE,LEVEL))return 1;
+	else if(STRESS>0)LEVEL=generateLevel(SEED,STRESS);
+	trace.registerthread("main");
+	jobs.start(THREADS>0?THREADS:std::thread::hardware_concurrency());
 	allobstacles = new obstacle[20];
+	if(SIMULATE){
+		runSimulation();
+		return 0;
+	}
+	if(OFFSCREEN>0){              //no window, render and report
+		runOffscreen(width, height);
+		return 0;
+	}
 	GLFWwindow* window = initGLFW(width, height);
 
 	initGL (window, width, height);
 
-	double last_update_time = glfwGetTime(), current_time;
+	double last_update_time = glfwGetTime(), current_time, last_frame_time = last_update_time;
 
 	/* Draw in loop */
 	while (!glfwWindowShouldClose(window)) {
-		reshapeWindow(window,width,height);        //handle zoom
+		if(PROFILING)prof.endframe();
+		TRACE("frame");
+		input.collect(false);
+		current_time = glfwGetTime();
+		shaderwatch.poll();                                      //swap in edited shaders
+		gamecamera.update(current_time-last_frame_time);        //handle zoom,pan and resize
+		last_frame_time = current_time;
+		if(LOWLATENCY){
+			profilescope events(PHASE_EVENTS);
+			input.late(window, pacing.period());                  //aim from the cursor as late as possible
+		}
+		step();
 		// OpenGL Draw commands
 		draw();
+		input.rendered();
+		profilescope clear(PHASE_CLEAR);
 		clearcollisions(my);
+		clear.stop();
 		//printf("%lf %lf \n",xp,yp);
 		// Swap Frame Buffer in double buffering
+		profilescope swap(PHASE_SWAP);
+		pacing.wait();
 		glfwSwapBuffers(window);
+		input.afterswap();
+		swap.stop();
 
 		if(TARGETS==0)SCORE+=50*LIFES;
 		
 		// Poll for Keyboard and mouse events
+		profilescope events(PHASE_EVENTS);          //until the end of the frame
 		glfwPollEvents();
-		if(glfwGetKey(window,GLFW_KEY_A)==GLFW_PRESS)pipe_rot+=1;
-		if(glfwGetKey(window,GLFW_KEY_B)==GLFW_PRESS)pipe_rot-=1;
+		if(!LOWLATENCY)input.polled();
 
 		printf("SCORE: %d\n",SCORE);
 		
-		// Control based on time (Time based transformation like 5 degrees rotation every 0.5s)
+		// Held keys and buttons act per 1/60 s, scaled by the time this frame took
+		// so aiming and power feel the same at any frame rate
 		current_time = glfwGetTime(); // Time in seconds
-		if ((current_time - last_update_time) >= 10e-9) { // atleast 0.5s elapsed since last frame
-			// do something every 0.5 seconds ..
-			// double xp,yp,lx,ly;
-			// glfwGetCursorPos(window,&xp,&yp);
-			// ly=height/2.0 + abs(my.y)-yp;
-			// lx=xp-width/2.0+abs(my.x);
-			// //printf("lx:%lf ly:%lf\n",lx,ly );
-			// pipe_rot=M_PI/2.0+atan(ly/lx)*180.0f/M_PI;
-			
-			allobstacles[0].move(1.0);
-			allobstacles[1].move(2.0);
-			if(glfwGetMouseButton(window,GLFW_MOUSE_BUTTON_1)==GLFW_PRESS){
-				//printf("left button pressed\n");
-				s*=0.99;
-				if(!my.isshoot)my.vel*=my.k;
-				my.translate = glm::translate(glm::vec3(0,my.rs*50.0-50.0,0));
-				MOUSEPRESSED=1;
-			}
-			if(glfwGetMouseButton(window,GLFW_MOUSE_BUTTON_1)==GLFW_RELEASE){
-				//printf("left button released\n");
-				ang = -1.f*pipe_rot*M_PI/180.f;  //don't mess with ang
-				ang = 0.5*M_PI - ang;
-				if(!ballinsky&&LIFES>0&&MOUSEPRESSED){
-					s=1;
-					my.shoot(ang);           
-					my.shootpower=true;
-					MANPAN=false;
-					LIFES--;
-					MOUSEPRESSED=0;  
-				}
-				// s*=0.99;
-				// if(!my.isshoot)my.vel*=my.k;
-				// my.translate = glm::translate(glm::vec3(0,my.rs*50.0-50.0,0));
-			}
-			if(glfwGetKey(window,GLFW_KEY_LEFT)==GLFW_PRESS){
-				if(PANX>0&&MANPAN)PANX-=10.0;
-			}
-			if(glfwGetKey(window,GLFW_KEY_RIGHT)==GLFW_PRESS){
-				if(PANX<650&&MANPAN)PANX+=10.0;
+		float frames = 60*min(current_time - last_update_time, 0.1);  //clamp stalls (window drag,breakpoints)
+		last_update_time = current_time;
+		if(glfwGetKey(window,GLFW_KEY_A)==GLFW_PRESS)pipe_rot+=frames;
+		if(glfwGetKey(window,GLFW_KEY_B)==GLFW_PRESS)pipe_rot-=frames;
+		// double xp,yp,lx,ly;
+		// glfwGetCursorPos(window,&xp,&yp);
+		// ly=height/2.0 + abs(my.y)-yp;
+		// lx=xp-width/2.0+abs(my.x);
+		// //printf("lx:%lf ly:%lf\n",lx,ly );
+		// pipe_rot=M_PI/2.0+atan(ly/lx)*180.0f/M_PI;
+		
+		moveWalls(frames);
+		if(glfwGetMouseButton(window,GLFW_MOUSE_BUTTON_1)==GLFW_PRESS){
+			//printf("left button pressed\n");
+			s*=pow(0.99,frames);
+			if(!my.isshoot)my.vel*=pow(my.k,frames);
+			my.translate = glm::translate(glm::vec3(0,my.rs*50.0-50.0,0));
+			MOUSEPRESSED=1;
+		}
+		if(glfwGetMouseButton(window,GLFW_MOUSE_BUTTON_1)==GLFW_RELEASE){
+			//printf("left button released\n");
+			ang = -1.f*pipe_rot*M_PI/180.f;  //don't mess with ang
+			ang = 0.5*M_PI - ang;
+			if(!ballinsky&&LIFES>0&&MOUSEPRESSED){
+				s=1;
+				my.shoot(ang);           
+				my.shootpower=true;
+				MANPAN=false;
+				LIFES--;
+				MOUSEPRESSED=0;  
 			}
-			if(glfwGetKey(window,GLFW_KEY_F)==GLFW_PRESS){
-				s*=0.99;
-				if(!my.isshoot)my.vel*=my.k;
+			// s*=0.99;
+			// if(!my.isshoot)my.vel*=my.k;
+			// my.translate = glm::translate(glm::vec3(0,my.rs*50.0-50.0,0));
+		}
+		if(glfwGetKey(window,GLFW_KEY_LEFT)==GLFW_PRESS){
+			if(PANX>0&&MANPAN)PANX-=10.0*frames;
+		}
+		if(glfwGetKey(window,GLFW_KEY_RIGHT)==GLFW_PRESS){
+			if(PANX<650&&MANPAN)PANX+=10.0*frames;
+		}
+		if(glfwGetKey(window,GLFW_KEY_F)==GLFW_PRESS){
+			s*=pow(0.99,frames);
+			if(!my.isshoot)my.vel*=pow(my.k,frames);
+			my.translate = glm::translate(glm::vec3(0,my.rs*50.0-50.0,0));
+		}
+		if(glfwGetKey(window,GLFW_KEY_S)==GLFW_PRESS){
+			if(s<1){
+				s=min(1.0,s/pow(0.99,frames));
 				my.translate = glm::translate(glm::vec3(0,my.rs*50.0-50.0,0));
 			}
-			if(glfwGetKey(window,GLFW_KEY_S)==GLFW_PRESS){
-				if(s<1){
-					s/=0.99;
-					my.translate = glm::translate(glm::vec3(0,my.rs*50.0-50.0,0));
-				}
-			}
-			last_update_time = current_time;
 		}
 	}
 
+	prof.finish();
+	trace.write(TRACEFILE);
+	shaderwatch.finish();
+	jobs.finish();
+	gpumem.shutdown();
 	glfwTerminate();
 	exit(EXIT_SUCCESS);
 }
+#endif
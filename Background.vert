@@ -0,0 +1,16 @@
+#version 330 core
+
+// input data : a corner of the screen, in clip space
+layout (location = 0) in vec2 corner;
+
+uniform float offset;     // left edge of the view in the background texture, 0 to 1
+uniform float scale;      // width of the view in the background texture, 0 to 1
+
+// output data : used by fragment shader (Background.frag)
+out vec2 uv;
+
+void main ()
+{
+    uv = vec2(offset + scale * (corner.x * 0.5 + 0.5), corner.y * 0.5 + 0.5);
+    gl_Position = vec4(corner, 0, 1);
+}
@@ -0,0 +1,23 @@
+#version 330 core
+
+// input data : a corner of the quad, and per instance (particle) its position,
+// seconds left to live and color, streamed every frame
+layout (location = 0) in vec2 corner;
+layout (location = 2) in float particleX;
+layout (location = 3) in float particleY;
+layout (location = 4) in float life;
+layout (location = 5) in vec4 particleColor;
+
+uniform mat4 MVP;
+uniform float size;       // half width of a new particle
+
+// output data : used by fragment shader (Sample_GL.frag)
+out vec3 fragColor;
+
+void main ()
+{
+    // Shrink over the last half second, an expired particle collapses to a point
+    float s = size * clamp(2.0 * life, 0.0, 1.0);
+    fragColor = particleColor.rgb;
+    gl_Position = MVP * vec4(particleX + s * corner.x, particleY + s * corner.y, 0, 1);
+}
@@ -3,6 +3,7 @@
 // input data : sent from main program
 layout (location = 0) in vec3 vertexPosition;
 layout (location = 1) in vec3 vertexColor;
+layout (location = 2) in vec4 instance;          // per instance offset (xy) and scale (w), 0,0,0,1 unless drawn instanced
 
 uniform mat4 MVP;
 
@@ -11,7 +12,7 @@ out vec3 fragColor;
 
 void main ()
 {
-    vec4 v = vec4(vertexPosition, 1); // Transform an homogeneous 4D vector
+    vec4 v = vec4(vertexPosition * instance.w + vec3(instance.xy, 0), 1); // Transform an homogeneous 4D vector
 
     // The color of each vertex will be interpolated
     // to produce the color of each fragment
@@ -0,0 +1,230 @@
+// Physics microbenchmarks for AngryBirds.cpp, run with `make bench`
+// Prints ns/op and allocations/op and writes the same numbers as JSON so runs
+// can be diffed across commits.
+#define ANGRYBIRDS_NO_MAIN
+#include "AngryBirds.cpp"
+#include <new>
+#include <cstdlib>
+
+std::atomic<long> ALLOCS(0);     //operator new calls since last reset
+void* operator new(size_t n){
+	ALLOCS++;
+	void *p = malloc(n ? n : 1);
+	if(!p)throw std::bad_alloc();
+	return p;
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+typedef struct benchresult{
+	string name;
+	double ns, allocs;
+	long iters;
+}benchresult;
+vector<benchresult> results;
+
+/* Run f in batches until a batch takes at least 0.2 s, keep the last batch */
+template<typename F> void bench(const char *name, F f){
+	typedef std::chrono::steady_clock clock;
+	f();                                      //warm up caches and pools
+	long iters = 1;
+	for(;;){
+		ALLOCS = 0;
+		clock::time_point t0 = clock::now();
+		for(long i = 0; i < iters; ++i)f();
+		double ns = std::chrono::duration<double, std::nano>(clock::now() - t0).count();
+		long allocs = ALLOCS;
+		if(ns >= 2e8 || iters >= (1L << 26)){
+			benchresult r = {name, ns / iters, (double)allocs / iters, iters};
+			results.push_back(r);
+			printf("%-40s %12.1f ns/op %8.2f allocs/op %10ld iters\n", name, r.ns, r.allocs, iters);
+			return;
+		}
+		iters = ns < 1e6 ? iters * 100 : (long)(iters * 2.5e8 / ns) + 1;
+	}
+}
+template<typename T> void keep(T &v){ asm volatile("" : : "g"(&v) : "memory"); }
+
+/* The built-in level for n<=12, otherwise a generated one with n obstacles */
+void makeScene(int n){
+	createStressLevel(n > 12 ? n : 0);
+	SCORE=0,LIFES=5,BALLCOUNT=0;
+	my.init();
+	translateTargets();
+	for(int i = 0; i < OBSTACLES; ++i)allobstacles[i].update();
+}
+
+/* One frame of the game loop without rendering: a ball is always in flight */
+void worldstep(){
+	SIMCLOCK += 1.0 / 60;
+	if(!my.isshoot){
+		my.place(0, 25+10+15, 1);
+		my.shoot(0.8);
+	}
+	step();
+	clearcollisions(my);
+	moveWalls(1);
+}
+
+void writejson(const char *path){
+	FILE *out = fopen(path, "w");
+	if(!out){
+		printf("Could not write %s\n", path);
+		return;
+	}
+	fprintf(out, "{\n  \"gl\": %s,\n  \"results\": [\n", HEADLESS ? "false" : "true");
+	for(size_t i = 0; i < results.size(); ++i)
+		fprintf(out, "    {\"name\": \"%s\", \"ns_per_op\": %.2f, \"allocs_per_op\": %.3f, \"iterations\": %ld}%s\n",
+			results[i].name.c_str(), results[i].ns, results[i].allocs, results[i].iters, i + 1 < results.size() ? "," : "");
+	fprintf(out, "  ]\n}\n");
+	fclose(out);
+	printf("Wrote %s\n", path);
+}
+
+int main(int argc, char **argv){
+	const char *path = argc > 1 ? argv[1] : "bench.json";
+	HEADLESS = !initEGL(64, 64);
+	if(HEADLESS)printf("No GL context, createCircle measures vertex generation only\n");
+	SIMCLOCK = 0;
+	allobstacles = new obstacle[20];
+	makeScene(12);
+
+	ball b;
+	b.r = 15, b.stx = b.sty = 0;
+	obstacle &rect = allobstacles[2], &target = allobstacles[3];
+	bench("obstacle::checkCollision miss", [&]{
+		b.x = -400, b.y = 300, b.isshoot = true;
+		rect.checkCollision(b);
+	});
+	bench("obstacle::checkCollision hit", [&]{
+		b.x = rect.x - rect.w / 2 - 5, b.y = rect.y, b.velx = 200, b.vely = -50, b.isshoot = true;
+		b.touching = -1;
+		rect.checkCollision(b);
+	});
+	bench("obstacle::hit", [&]{
+		b.x = target.x, b.y = target.y;
+		target.available = true, target.numhit = -1, target.r = 50;
+		target.hit(b);
+	});
+	bench("ground::checkCollision", [&]{
+		b.x = 0, b.y = -310, b.velx = 150, b.vely = -200;
+		b.isshoot = b.falling = true, b.collision_ground = false;
+		gameground.checkCollision(b);
+	});
+	bench("handleCollisionCircle", [&]{
+		b.x = target.x - 60, b.y = target.y + 10, b.velx = 200, b.vely = -50, b.vel = 206;
+		handleCollisionCircle(b, target);
+	});
+	bench("createCircle", []{
+		vaohandle c = createCircle(15, color(0,0,1));
+		keep(c);
+	});
+	bench("fragmentpool spawn+release", []{
+		fraghandle h = fragments.spawn();
+		fragments.release(h);
+	});
+	SPLIT = 200;
+	bench("splitBall 200 fragments", []{
+		my.place(0, 25+10+15, 1);
+		my.shoot(0.8);
+		splitBall(my);
+	});
+	fragments.clear(), SPLIT = 2;
+	SCORE=0;
+
+	// A full particle ring that never expires: integration, then the copy into the stream buffer
+	for(int i = 0; i < MAXPARTICLES / 100; ++i)particles.emit(0, 0, 300, false, DEBRIS, 100);
+	for(int i = 0; i < MAXPARTICLES; ++i)particles.life[i] = 1e9;
+	bench("particles advance 100k", []{
+		particles.advance(1.0 / 60);
+	});
+	if(!HEADLESS){
+		vertexstream.create();
+		particles.create();
+		bench("particles upload 100k", []{           //one frame's worth of vertexstream
+			vertexstream.begin();
+			int n = particles.upload();
+			vertexstream.end();
+			keep(n);
+		});
+	}
+	particles.clear();
+
+	// One whole shot, solved impact to impact against stepped frame by frame
+	makeScene(12);
+	my.place(0, 25+10+15, 1);
+	double sx = my.x, sy = my.y;
+	typedef struct saved{ glm::mat4 translateagain, scale; float r; bool dir, available; int numhit; float x, y, angle; }saved;
+	vector<saved> level(OBSTACLES);
+	vector<arbiter> arbiters = ARBITERS;
+	unordered_map<long long, arbiter> resting = RESTING;
+	for(int i = 0; i < OBSTACLES; ++i){
+		obstacle &o = allobstacles[i];
+		saved v = {o.translateagain, o.scale, o.r, o.dir, o.available, o.numhit, o.x, o.y, o.angle};
+		level[i] = v;
+	}
+	bench("shot analytic", [&]{
+		shotresult r = simulateShot(sx, sy, my.vel * cos(0.8), my.vel * sin(0.8), my.r, 60, NULL);
+		keep(r);
+	});
+	bench("shot fixed-step", [&]{
+		for(int i = 0; i < OBSTACLES; ++i){                  //targets hit and walls moved by the last shot come back
+			obstacle &o = allobstacles[i];
+			saved &v = level[i];
+			o.translateagain = v.translateagain, o.scale = v.scale, o.r = v.r;
+			o.dir = v.dir, o.available = v.available, o.numhit = v.numhit;
+			o.x = v.x, o.y = v.y, o.angle = v.angle;                  //knocked blocks too, asleep as placed
+			o.velx = o.vely = o.spin = 0, o.awake = false;
+			o.update();
+		}
+		ARBITERS = arbiters, RESTING = resting;
+		my.init();
+		worldstep();
+		for(int f = 0; f < 3600 && my.isshoot; ++f)worldstep();
+	});
+	SCORE=0;
+
+	// Rigid bodies: 50 columns of 40 blocks, all awake, as if a shot had hit everything
+	LEVEL.clear();
+	for(int c = 0; c < 50; ++c)
+		for(int k = 0; k < 40; ++k){
+			levelobject o = {'b', 20, 20, 150 + c * 22.0f, -325 + 10 + k * 20.0f, 0};
+			LEVEL.push_back(o);
+		}
+	initObjects();
+	bench("bodies step 2000 awake", []{
+		for(int i = 0; i < OBSTACLES; ++i)allobstacles[i].wake();
+		stepBodies(BODYDT);
+	});
+
+	int sizes[] = {12, 200, 2000, 20000};
+	for(int i = 0; i < 4; ++i){
+		char name[64];
+		makeScene(sizes[i]);
+		sprintf(name, "world step %d obstacles", sizes[i]);
+		bench(name, worldstep);
+	}
+
+	// Speedup of the job system on generated levels with every body knocked awake
+	int threads[] = {1, 2, 4, 8, 16, 32};
+	printf("%u cores\n", std::thread::hardware_concurrency());
+	for(int i = 2; i < 4; ++i){
+		double single = 0;
+		for(int t = 0; t < 6; ++t){
+			char name[64];
+			jobs.start(threads[t]);
+			makeScene(sizes[i]);
+			sprintf(name, "bodies step %d awake, %d threads", sizes[i], threads[t]);
+			bench(name, []{
+				for(int k = 0; k < OBSTACLES; ++k)allobstacles[k].wake();
+				stepBodies(BODYDT);
+			});
+			if(t == 0)single = results.back().ns;
+			printf("%-40s %12.2fx\n", "  speedup", single / results.back().ns);
+		}
+	}
+	jobs.finish();
+	writejson(path);
+	gpumem.shutdown();
+	return 0;
+}
@@ -0,0 +1,147 @@
+// Golden-image render check for AngryBirds.cpp, run with `make golden`
+// Renders fixed world snapshots on a surfaceless EGL context, reads them back
+// through pixel buffer objects and compares them with golden/<name>.png.
+// `make golden-update` rewrites the golden images after an intended change.
+#define ANGRYBIRDS_NO_MAIN
+#include "AngryBirds.cpp"
+#include <png.h>
+
+const int W = 650, H = 500;        //half the window, enough to see every object
+const int CHANNELTOL = 2;          //per channel difference ignored (rasterizer rounding)
+const double PIXELTOL = 0.001;     //fraction of pixels allowed to differ beyond CHANNELTOL
+
+typedef struct snapshot{
+	const char *name;
+	int stress, frames;            //generated obstacles (0 built-in level), frames simulated before the capture
+	float panx, zoom;              //camera, panx<0 follows the ball
+	bool shoot;
+}snapshot;
+snapshot SNAPSHOTS[] = {
+	{"level", 0, 1, 0, 1, false},
+	{"flight", 0, 25, -1, 1, true},
+	{"targets", 0, 1, 650, 1, false},
+	{"zoomout", 0, 1, 325, 2, false},
+	{"stress", 2000, 1, 325, 1.5, false},
+};
+const int NSNAPSHOTS = sizeof(SNAPSHOTS) / sizeof(SNAPSHOTS[0]);
+
+/* Same state every time: fresh level, cannon at its start angle, clock at 0 */
+void render(snapshot &snap){
+	createStressLevel(snap.stress);
+	SCORE=0,LIFES=5,BALLCOUNT=0;
+	pipe_rot=-52, firsttime=true, SIMCLOCK=0;
+	my.init();
+	for(int f = 0; f < snap.frames; ++f){
+		SIMCLOCK += 1.0 / 60;
+		if(snap.shoot && f == 0){
+			my.place(0, 25+10+15, 1);
+			my.shoot(0.8);
+		}
+		step();
+		clearcollisions(my);
+	}
+	if(snap.panx >= 0)PANX = snap.panx;
+	ZOOM = gamecamera.zoom = snap.zoom;
+	gamecamera.apply();
+	gamecamera.view();
+	draw();
+}
+
+bool readpng(const char *path, vector<unsigned char> &pixels){
+	png_image image;
+	memset(&image, 0, sizeof(image));
+	image.version = PNG_IMAGE_VERSION;
+	if(!png_image_begin_read_from_file(&image, path))return false;
+	image.format = PNG_FORMAT_RGB;
+	if(image.width != W || image.height != H){
+		png_image_free(&image);
+		return false;
+	}
+	pixels.resize(PNG_IMAGE_SIZE(image));
+	return png_image_finish_read(&image, NULL, &pixels[0], 0, NULL);
+}
+
+bool writepng(const char *path, vector<unsigned char> &pixels){
+	png_image image;
+	memset(&image, 0, sizeof(image));
+	image.version = PNG_IMAGE_VERSION;
+	image.width = W, image.height = H;
+	image.format = PNG_FORMAT_RGB;
+	return png_image_write_to_file(&image, path, 0, &pixels[0], 0, NULL);
+}
+
+/* Map the pixel buffer once its fence has signalled, flip to top-down rows and
+   compare (or store) against the golden image. Returns false on mismatch */
+bool check(snapshot &snap, GLuint pbo, GLsync fence, const char *dir, bool update){
+	glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+	glDeleteSync(fence);
+	vector<unsigned char> actual(W * H * 3), golden;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+	unsigned char *p = (unsigned char *) glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, W * H * 3, GL_MAP_READ_BIT);
+	for(int y = 0; y < H; ++y)memcpy(&actual[(H - 1 - y) * W * 3], p + y * W * 3, W * 3);
+	glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	char path[512];
+	snprintf(path, sizeof(path), "%s/%s.png", dir, snap.name);
+	if(update){
+		bool ok = writepng(path, actual);
+		printf("%-10s %s %s\n", snap.name, ok ? "wrote" : "could not write", path);
+		return ok;
+	}
+	if(!readpng(path, golden)){
+		printf("%-10s FAIL no %dx%d golden image %s\n", snap.name, W, H, path);
+		return false;
+	}
+	int differ = 0, maxdelta = 0;
+	for(int i = 0; i < W * H; ++i){
+		int d = 0;
+		for(int c = 0; c < 3; ++c)d = max(d, abs(actual[3 * i + c] - golden[3 * i + c]));
+		if(d > CHANNELTOL)differ++;
+		maxdelta = max(maxdelta, d);
+	}
+	bool ok = differ <= PIXELTOL * W * H;
+	printf("%-10s %s %d pixels differ, max delta %d\n", snap.name, ok ? "ok  " : "FAIL", differ, maxdelta);
+	if(!ok){
+		snprintf(path, sizeof(path), "%s/%s.actual.png", dir, snap.name);
+		writepng(path, actual);
+		printf("%-10s wrote %s\n", snap.name, path);
+	}
+	return ok;
+}
+
+int main(int argc, char **argv){
+	const char *dir = argc > 1 ? argv[1] : "golden";
+	bool update = argc > 2 && !strcmp(argv[2], "--update");
+	if(!initEGL(W, H)){
+		printf("Could not create a surfaceless EGL context\n");
+		return 1;
+	}
+	allobstacles = new obstacle[20];
+	initGL(NULL, W, H);
+
+	// Two pixel buffers: snapshot i is read back while snapshot i+1 renders
+	GLuint pbo[2];
+	GLsync fence[2];
+	glGenBuffers(2, pbo);
+	for(int i = 0; i < 2; ++i){
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[i]);
+		glBufferData(GL_PIXEL_PACK_BUFFER, W * H * 3, NULL, GL_STREAM_READ);
+	}
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);      //tightly packed RGB rows, the shaders write no alpha
+	int failed = 0;
+	for(int i = 0; i <= NSNAPSHOTS; ++i){
+		if(i < NSNAPSHOTS){
+			render(SNAPSHOTS[i]);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[i % 2]);
+			glReadPixels(0, 0, W, H, GL_RGB, GL_UNSIGNED_BYTE, 0);    //into the buffer, returns at once
+			fence[i % 2] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		}
+		if(i > 0 && !check(SNAPSHOTS[i - 1], pbo[(i - 1) % 2], fence[(i - 1) % 2], dir, update))failed++;
+	}
+	glDeleteBuffers(2, pbo);
+	gpumem.shutdown();
+	if(failed)printf("%d of %d snapshots differ from %s\n", failed, NSNAPSHOTS, dir);
+	return failed ? 1 : 0;
+}